@@ -1,12 +1,29 @@
 #ifndef _TAGTREE_BITMAP_H_
 #define _TAGTREE_BITMAP_H_
 
+#include "roaring.hh"
+
 #include <cstddef>
+#include <cstdint>
 
 namespace tagtree {
 
 extern void bitmap_and(const void* a, const void* b, void* c, size_t size);
 extern void bitmap_or(const void* a, const void* b, void* c, size_t size);
+/* c = a & ~b */
+extern void bitmap_andnot(const void* a, const void* b, void* c, size_t size);
+
+/* Add the set bits of a page bitmap to a roaring bitmap. Bit i of the page
+ * bitmap is added as base + i. size must be a multiple of 8. */
+extern void bitmap_to_roaring(const void* bitmap, size_t size, uint32_t base,
+                              Roaring& roaring);
+/* Set the bits of the values in [base, base + size * 8) of a roaring bitmap
+ * in a page bitmap. size must be a multiple of 8. */
+extern void roaring_to_bitmap(const Roaring& roaring, uint32_t base,
+                              void* bitmap, size_t size);
+
+/* Number of set bits of a page bitmap. size must be a multiple of 8. */
+extern size_t bitmap_popcount(const void* bitmap, size_t size);
 
 } // namespace tagtree
 
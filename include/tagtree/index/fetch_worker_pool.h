@@ -0,0 +1,42 @@
+#ifndef _TAGTREE_FETCH_WORKER_POOL_H_
+#define _TAGTREE_FETCH_WORKER_POOL_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace tagtree {
+
+/* Threads that read posting pages for the scans of all index trees. A task
+ * returns a copy of the page it reads. */
+class FetchWorkerPool {
+public:
+    using PageBuffer = std::unique_ptr<uint8_t[]>;
+    using Task = std::packaged_task<PageBuffer()>;
+
+    explicit FetchWorkerPool(unsigned int num_workers);
+    ~FetchWorkerPool();
+
+    bool empty() const { return workers.empty(); }
+
+    /* Queue the tasks at once so that the reads are issued together. */
+    void submit(std::vector<Task>& tasks);
+
+private:
+    std::vector<std::thread> workers;
+    std::deque<Task> queue;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping;
+
+    void worker();
+};
+
+} // namespace tagtree
+
+#endif
@@ -1,14 +1,17 @@
 #ifndef _TAGTREE_INDEX_SERVER_H_
 #define _TAGTREE_INDEX_SERVER_H_
 
-#include "tagtree/index/index_tree.h"
 #include "tagtree/index/mem_index.h"
+#include "tagtree/index/partitioned_index_tree.h"
+#include "tagtree/index/postings.h"
 #include "tagtree/series/series_manager.h"
 #include "tagtree/wal/records.h"
 #include "tagtree/wal/wal.h"
 
 #include <atomic>
+#include <list>
 #include <memory>
+#include <optional>
 #include <unordered_map>
 
 namespace tagtree {
@@ -24,7 +27,9 @@ public:
     IndexServer(std::string_view index_dir, size_t cache_size,
                 AbstractSeriesManager* sm, bool bitmap_only = false,
                 bool full_cache = true,
-                CheckpointPolicy checkpoint_policy = CheckpointPolicy::NORMAL);
+                CheckpointPolicy checkpoint_policy = CheckpointPolicy::NORMAL,
+                uint64_t partition_duration =
+                    PartitionedIndexTree::DEFAULT_PARTITION_DURATION);
 
     AbstractSeriesManager* get_series_manager() const { return series_manager; }
 
@@ -32,6 +37,20 @@ public:
     resolve_label_matchers(const std::vector<promql::LabelMatcher>& matchers,
                            uint64_t start, uint64_t end, MemPostingList& tsids);
 
+    /* Lazy version of resolve_label_matchers(). The postings in the tree are
+     * read segment by segment as the iterator advances. The result is added
+     * to the query cache if no seek() skips postings before the end. */
+    std::unique_ptr<PostingsIterator>
+    get_postings(const std::vector<promql::LabelMatcher>& matchers,
+                 uint64_t start, uint64_t end);
+
+    /* Estimate the number of series matched by the matchers without reading
+     * the posting pages of the tree. Exact for the series in the memory
+     * index, an upper bound for the series in the tree. */
+    size_t
+    estimate_cardinality(const std::vector<promql::LabelMatcher>& matchers,
+                         uint64_t start, uint64_t end);
+
     void exists(const std::vector<promql::Label>& labels, MemPostingList& tsids,
                 bool skip_tree = false);
 
@@ -41,17 +60,24 @@ public:
                                      const std::vector<promql::Label>& labels);
 
     void label_values(const std::string& label_name,
-                      std::unordered_set<std::string>& values);
+                      std::unordered_set<std::string>& values,
+                      uint64_t start = 0, uint64_t end = UINT64_MAX);
+    void label_names(std::unordered_set<std::string>& names,
+                     uint64_t start = 0, uint64_t end = UINT64_MAX);
 
     void commit(const std::vector<SeriesRef>& series);
 
     void manual_compact();
 
+    /* Delete the index partitions that only have postings before the
+     * retention timestamp. */
+    size_t drop_expired(uint64_t retention_timestamp);
+
     TSID current_tsid() const { return id_counter.load(); }
 
 private:
     MemIndex mem_index;
-    IndexTree index_tree;
+    PartitionedIndexTree index_tree;
     AbstractSeriesManager* series_manager;
     WAL wal;
     std::atomic<TSID> id_counter;
@@ -70,6 +96,51 @@ private:
     void compact(TSID current_id);
 
     void replay_wal();
+
+    /* Cached results of resolve_label_matchers(). An entry is valid as long
+     * as the tree is not changed by a compaction. Series added after the
+     * entry is created (TSID >= watermark) are checked against the matchers
+     * on a hit. */
+    struct CachedPostings {
+        MemPostingList tsids;
+        unsigned int tree_version;
+        uint64_t compaction_timestamp;
+        TSID watermark;
+    };
+
+    static const size_t QUERY_CACHE_SIZE = 256;
+    /* recompute the result if there are more new series to check */
+    static const size_t QUERY_CACHE_MAX_DELTA = 4096;
+
+    using QueryCacheList = std::list<std::pair<std::string, CachedPostings>>;
+    QueryCacheList query_cache_list;
+    std::unordered_map<std::string, QueryCacheList::iterator> query_cache_map;
+    std::mutex query_cache_mutex;
+
+    std::string
+    get_query_cache_key(const std::vector<promql::LabelMatcher>& matchers,
+                        uint64_t start, uint64_t end);
+    bool lookup_query_cache(const std::string& key,
+                            const std::vector<promql::LabelMatcher>& matchers,
+                            MemPostingList& tsids);
+    void insert_query_cache(const std::string& key, const MemPostingList& tsids,
+                            unsigned int tree_version,
+                            uint64_t compaction_timestamp, TSID watermark);
+
+    /* Adds the postings of get_postings() to the query cache once they are
+     * fully iterated. */
+    class QueryCachePostingsIterator;
+
+    /* Look up the series whose label set is exactly the one given by a set
+     * of equality matchers. */
+    std::optional<TSID>
+    get_tsid_by_matchers(const std::vector<promql::LabelMatcher>& matchers);
+
+    /* Order the matchers by their estimated selectivity. Positive matchers
+     * that match fewer series are evaluated first and negative matchers are
+     * moved to the end so that they are applied as subtractions. */
+    void plan_matchers(const std::vector<promql::LabelMatcher>& matchers,
+                       std::vector<promql::LabelMatcher>& plan);
 };
 
 } // namespace tagtree
@@ -12,16 +12,28 @@
 #include "bptree/page_cache.h"
 #include "bptree/tree.h"
 #include "promql/labels.h"
+#include "tagtree/index/fetch_worker_pool.h"
+#include "tagtree/index/label_catalog.h"
 #include "tagtree/index/mem_index.h"
+#include "tagtree/index/postings.h"
+#include "tagtree/index/regex_literals.h"
 #include "tagtree/series/series_manager.h"
 #include "tagtree/tree/cow_tree_node.h"
+#include "tagtree/tree/recycling_page_cache.h"
 #include "tagtree/tsid.h"
 
+#include <algorithm>
 #include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <set>
+#include <shared_mutex>
 #include <type_traits>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
@@ -29,23 +41,83 @@ namespace tagtree {
 
 class IndexServer;
 
+/* Posting page metadata is duplicated in the tree values so that pages can be
+ * pruned without fetching them. */
 struct TreeValue {
+    SymbolTable::Ref name_ref;
+    /* sorted list pages hold the range of the value refs in the page */
     SymbolTable::Ref value_ref;
+    uint16_t page_type;
+    /* number of postings in the page, saturated at MAX_NUM_POSTINGS */
+    uint16_t num_postings;
+    /* inline values keep their postings in place of the fields from
+     * max_value_ref to value_filter */
+    SymbolTable::Ref max_value_ref;
     bptree::PageID page_id;
-
-    explicit TreeValue() : value_ref(0), page_id(bptree::Page::INVALID_PAGE_ID)
+    /* bloom filter of the value refs in a sorted list page, 0 if unknown */
+    uint32_t value_filter;
+    uint64_t end_timestamp;
+
+    static const uint16_t MAX_NUM_POSTINGS = UINT16_MAX;
+    /* postings are stored as 16-bit offsets into the segment */
+    static const size_t MAX_INLINE_POSTINGS = 6;
+
+    explicit TreeValue()
+        : name_ref(0), value_ref(0), page_type(0), num_postings(0),
+          max_value_ref(0), page_id(bptree::Page::INVALID_PAGE_ID),
+          value_filter(0), end_timestamp(0)
     {}
-    TreeValue(SymbolTable::Ref value_ref, bptree::PageID page_id)
-        : value_ref(value_ref), page_id(page_id)
+    TreeValue(SymbolTable::Ref name_ref, SymbolTable::Ref value_ref,
+              bptree::PageID page_id, uint16_t page_type,
+              uint64_t end_timestamp, size_t num_postings)
+        : name_ref(name_ref), value_ref(value_ref), page_type(page_type),
+          num_postings((uint16_t)std::min(num_postings,
+                                          (size_t)MAX_NUM_POSTINGS)),
+          max_value_ref(value_ref), page_id(page_id), value_filter(0),
+          end_timestamp(end_timestamp)
     {}
+
+    void get_inline_postings(uint16_t* offsets) const
+    {
+        ::memcpy(offsets, &max_value_ref, num_postings * sizeof(uint16_t));
+    }
+
+    void set_inline_postings(const uint16_t* offsets, size_t count)
+    {
+        assert(count <= MAX_INLINE_POSTINGS);
+        ::memcpy(&max_value_ref, offsets, count * sizeof(uint16_t));
+        num_postings = (uint16_t)count;
+    }
+
+    static uint32_t get_filter_bits(SymbolTable::Ref ref)
+    {
+        uint32_t h = ref * 0x9e3779b1U;
+        return (1U << (h >> 27)) | (1U << ((h >> 22) & 31));
+    }
+
+    /* Check if a sorted list page may contain the postings of a value. */
+    bool may_contain(SymbolTable::Ref ref) const
+    {
+        if (!value_filter) return true;
+
+        auto bits = get_filter_bits(ref);
+        return ref >= value_ref && ref <= max_value_ref &&
+               (value_filter & bits) == bits;
+    }
 };
-static_assert(sizeof(TreeValue) == 8, "TreeValue has wrong size");
+static_assert(sizeof(TreeValue) == 32, "TreeValue has wrong size");
+static_assert(offsetof(TreeValue, end_timestamp) -
+                      offsetof(TreeValue, max_value_ref) >=
+                  TreeValue::MAX_INLINE_POSTINGS * sizeof(uint16_t),
+              "inline postings overlap end_timestamp");
 
-class IndexTree {
+class IndexTree : public std::enable_shared_from_this<IndexTree> {
 public:
+    /* Posting pages are read by the workers of fetch_pool if it is given.
+     * The pool can be shared by several trees. */
     IndexTree(IndexServer* server, std::string_view filename, size_t cache_size,
-              bool bitmap_only);
-    ~IndexTree();
+              bool bitmap_only,
+              std::shared_ptr<FetchWorkerPool> fetch_pool = nullptr);
 
     void write_postings(TSID limit, MemIndexSnapshot& snapshot);
 
@@ -53,38 +125,149 @@ public:
     resolve_label_matchers(const std::vector<promql::LabelMatcher>& matcher,
                            uint64_t start, uint64_t end, Roaring& postings);
 
-    void label_values(const std::string& label_name,
-                      std::unordered_set<std::string>& values);
+    /* Same as resolve_label_matchers() but the postings are produced segment
+     * by segment as the iterator advances. Only the tree values are read
+     * upfront. The iterator keeps the tree alive so the tree must be owned by
+     * a shared_ptr. */
+    std::unique_ptr<PostingsIterator>
+    get_postings(const std::vector<promql::LabelMatcher>& matchers,
+                 uint64_t start, uint64_t end);
+
+    void label_values(const std::string& label_name, uint64_t start,
+                      uint64_t end, std::unordered_set<std::string>& values);
+    void label_names(uint64_t start, uint64_t end,
+                     std::unordered_set<std::string>& names);
+
+    /* Estimate the number of postings matched by a positive matcher from the
+     * label statistics collected by write_postings(). */
+    size_t estimate_postings(const promql::LabelMatcher& matcher);
+
+    /* Upper bound of the number of series matched by the matchers computed
+     * from the posting counts in the tree values. No posting page is read. */
+    size_t
+    estimate_cardinality(const std::vector<promql::LabelMatcher>& matchers,
+                         uint64_t start, uint64_t end);
+
+    /* Time range of the postings written to the tree. Return false if the
+     * tree is empty. */
+    bool get_time_range(uint64_t& min_timestamp, uint64_t& max_timestamp)
+    {
+        return catalog.get_time_range(min_timestamp, max_timestamp);
+    }
+
+    /* Version of the tree, increased by every write_postings(). */
+    unsigned int get_version() const { return cow_tree.get_latest_version(); }
+
+    /* Change the budget of the node cache in pages. */
+    void set_cache_size(size_t cache_size)
+    {
+        cow_tree.set_node_cache_size(cache_size * page_cache->get_page_size());
+    }
 
 private:
-    static const size_t NAME_BYTES = 6;
+    /* label names are stored as symbol refs */
+    static const size_t NAME_BYTES = sizeof(SymbolTable::Ref);
     static const size_t VALUE_BYTES = 8;
     static const size_t SEGSEL_BYTES = 2;
 
     static const size_t BITMAP_PAGE_OFFSET =
         2 * sizeof(SymbolTable::Ref) + sizeof(uint64_t);
 
+    /* reserved label value of the postings of all series with a label name */
+    static constexpr const char* PRESENCE_LABEL_VALUE = "\xff";
+
+    /* size of the pages of the index file */
+    static const size_t PAGE_SIZE = 4096;
+
+    /* on-disk format of the keys, tree values and posting pages. Bump it
+     * whenever any of them changes. */
+    static const uint32_t FORMAT_VERSION = 3;
+
     using KeyType = TupleKey<NAME_BYTES, VALUE_BYTES>;
-    using COWTreeType = tagtree::COWTree<100, KeyType, TreeValue>;
+    using COWTreeType =
+        tagtree::COWTree<cow_tree_fanout<PAGE_SIZE, KeyType, TreeValue>(),
+                         KeyType, TreeValue>;
 
     struct TreeEntry {
         IndexTree::KeyType key;
-        SymbolTable::Ref value_ref;
-        bptree::PageID pid;
+        TreeValue value;
+        /* updated entries replace old_value in the tree */
         bool updated;
+        TreeValue old_value;
+
+        TreeEntry(IndexTree::KeyType key, const TreeValue& value, bool updated,
+                  const TreeValue& old_value)
+            : key(key), value(value), updated(updated), old_value(old_value)
+        {}
+    };
+
+    /* a posting page to be read by a scan */
+    struct PendingPage {
+        TreeValue val;
+        unsigned int segsel;
 
-        TreeEntry(IndexTree::KeyType key, SymbolTable::Ref value_ref,
-                  bptree::PageID pid, bool updated)
-            : key(key), value_ref(value_ref), pid(pid), updated(updated)
+        PendingPage(const TreeValue& val, unsigned int segsel)
+            : val(val), segsel(segsel)
         {}
     };
 
+    using PageBuffer = FetchWorkerPool::PageBuffer;
+
+    /* scans read the posting pages in batches of PREFETCH_BATCH pages that
+     * are fetched concurrently by the fetch workers */
+    static const size_t PREFETCH_BATCH = 16;
+
+    /* posting pages of a matcher grouped by segment */
+    struct MatcherPages {
+        bool negative;
+        std::map<unsigned int, std::vector<TreeValue>> pages;
+        /* pages of the excluded value of a negative matcher */
+        std::map<unsigned int, std::vector<TreeValue>> excluded;
+        Roaring list_postings;
+    };
+
+    class SegmentPostingsIterator;
+
+    struct LabelStats {
+        size_t num_values;
+        size_t num_postings;
+
+        LabelStats() : num_values(0), num_postings(0) {}
+    };
+
     IndexServer* server;
-    std::unique_ptr<bptree::AbstractPageCache> page_cache;
+    std::unique_ptr<RecyclingPageCache> page_cache;
     COWTreeType cow_tree;
+    /* posting pages replaced by the current compaction */
+    std::vector<bptree::PageID> retired_pages;
+    LabelCatalog catalog;
     size_t postings_per_page;
+    size_t max_inline_postings;
     bool bitmap_only;
 
+    std::shared_ptr<FetchWorkerPool> fetch_pool;
+
+    /* Read the pages of a batch and call fn on each page buffer in the order
+     * of the batch. Pages read by the fetch workers are copied out and
+     * unlocked on the worker so that no page lock is held across threads. */
+    void read_pages(
+        const std::vector<PendingPage>& batch,
+        const std::function<void(const PendingPage&, const uint8_t*)>& fn);
+    PageBuffer copy_page(bptree::PageID page_id);
+
+    std::unordered_map<std::string, LabelStats> label_stats;
+    std::shared_mutex stats_mutex;
+
+    void update_label_stats(const std::string& name,
+                            const std::vector<LabeledPostings>& entries);
+    void update_catalog(TSID limit, const std::string& name,
+                        const std::vector<LabeledPostings>& entries);
+    /* Record the page types of the tree entries written for a label name. */
+    void update_page_types(TSID limit,
+                           const std::vector<LabeledPostings>& entries,
+                           std::vector<TreeEntry>::const_iterator first,
+                           std::vector<TreeEntry>::const_iterator last);
+
     inline unsigned int tsid_segsel(TSID tsid)
     {
         return tsid / postings_per_page;
@@ -93,10 +276,26 @@ private:
     enum class TreePageType {
         BITMAP,
         SORTED_LIST,
+        ROARING,
+        /* postings are stored in the tree value */
+        INLINE,
     };
 
-    TreePageType choose_page_type(const std::string& tag_name,
-                                  const std::vector<LabeledPostings>& entry);
+    /* page type is encoded in the MSBs of the end timestamp */
+    static const uint64_t SORTED_LIST_PAGE_FLAG = 1ULL << 63;
+    static const uint64_t ROARING_PAGE_FLAG = 1ULL << 62;
+    static const uint64_t PAGE_TYPE_MASK =
+        SORTED_LIST_PAGE_FLAG | ROARING_PAGE_FLAG;
+
+    /* postings of a segment are packed into a shared roaring page if the
+     * serialized bitmap takes at most 1/ROARING_ITEM_FRACTION of a page */
+    static const size_t ROARING_ITEM_FRACTION = 4;
+    /* approximate size of a roaring item without its values */
+    static const size_t ROARING_ITEM_OVERHEAD = 24;
+
+    /* Choose between sorted lists and bitmap/roaring pages for the postings
+     * of a label value by the estimated space taken by each layout. */
+    TreePageType choose_page_type(const LabeledPostings& entry);
 
     size_t read_page_metadata(const uint8_t* buf, promql::Label& label,
                               uint64_t& end_timestamp, TreePageType& type);
@@ -109,40 +308,117 @@ private:
                                       uint64_t end_timestamp, TreePageType type,
                                       boost::upgrade_lock<bptree::Page>& lock);
 
+    /* Get a copy of the last sorted list page of a label name at start_time
+     * to be updated or a new page. Return true if a page is copied and set
+     * reused_val to the tree value of the page copied. */
     bool get_sorted_list_initial_segment(
         const std::string& name, uint64_t start_time, uint64_t end_time,
         uint32_t& segsel, bptree::Page*& posting_page,
-        boost::upgrade_lock<bptree::Page>& posting_page_lock);
+        boost::upgrade_lock<bptree::Page>& posting_page_lock,
+        TreeValue& reused_val);
 
     void write_postings_bitmap(TSID limit, const std::string& name,
                                const std::string& value, const Roaring& bitmap,
                                uint64_t min_timestamp, uint64_t max_timestamp,
+                               bptree::Page*& roaring_page,
+                               boost::upgrade_lock<bptree::Page>& roaring_lock,
                                std::vector<TreeEntry>& tree_entries);
-    void write_postings_sorted_list(TSID limit, const std::string& name,
-                                    const std::vector<LabeledPostings>& entries,
-                                    std::vector<TreeEntry>& tree_entries);
-
-    bptree::PageID
+    /* Postings of the values in converted found in the reused sorted list
+     * page are moved out of the page and added to converted. */
+    void write_postings_sorted_list(
+        TSID limit, const std::string& name,
+        const std::vector<LabeledPostings>& entries,
+        std::unordered_map<SymbolTable::Ref, Roaring>& converted,
+        std::vector<TreeEntry>& tree_entries);
+
+    TreeValue
     write_posting_page(const std::string& name, const std::string& value,
                        uint64_t start_timestamp, uint64_t end_timestamp,
                        unsigned int segsel,
                        const RoaringSetBitForwardIterator& first,
-                       const RoaringSetBitForwardIterator& last, bool& updated);
+                       const RoaringSetBitForwardIterator& last,
+                       bptree::Page*& roaring_page,
+                       boost::upgrade_lock<bptree::Page>& roaring_lock,
+                       bool& updated, TreeValue& old_val);
+
+    /* Append the postings of a segment to the shared roaring page of the
+     * label name. A new page is created when the current one is full. */
+    bptree::PageID
+    write_roaring_postings(const std::string& name, SymbolTable::Ref value_ref,
+                           uint64_t end_timestamp, unsigned int segsel,
+                           const Roaring& postings, bptree::Page*& roaring_page,
+                           boost::upgrade_lock<bptree::Page>& roaring_lock);
 
     void
     query_postings(const promql::LabelMatcher& matcher, uint64_t start,
                    uint64_t end,
                    std::map<unsigned int, std::unique_ptr<uint8_t[]>>& bitmaps,
                    const std::set<unsigned int>& seg_mask);
+    void query_postings_bitmap(
+        const promql::LabelMatcher& matcher, uint64_t start, uint64_t end,
+        std::map<unsigned int, std::unique_ptr<uint8_t[]>>& bitmaps,
+        const std::set<unsigned int>& seg_mask);
+    void query_postings_negative(
+        const promql::LabelMatcher& matcher, uint64_t start, uint64_t end,
+        std::map<unsigned int, std::unique_ptr<uint8_t[]>>& bitmaps,
+        const std::set<unsigned int>& seg_mask);
     void query_postings_sorted_list(
         const promql::LabelMatcher& matcher, uint64_t start, uint64_t end,
         std::map<unsigned int, std::unique_ptr<uint8_t[]>>& bitmaps,
         const std::set<unsigned int>& seg_mask);
+    void get_sorted_list_postings(const promql::LabelMatcher& matcher,
+                                  uint64_t start, uint64_t end,
+                                  Roaring& postings);
+
+    /* Intersect the postings of the matchers in a segment. */
+    void read_segment(const std::vector<MatcherPages>& matchers,
+                      unsigned int segsel, Roaring& postings);
+    void read_segment_pages(
+        const std::map<unsigned int, std::vector<TreeValue>>& pages,
+        unsigned int segsel, uint8_t* bmbuf);
+
+    /* Total number of postings in the sorted list pages of a label name. */
+    size_t count_sorted_list_postings(const std::string& name, uint64_t start,
+                                      uint64_t end);
+
+    /* Call fn on the tree values of the posting pages that may contain
+     * postings matched by a non-negative matcher. Sorted list pages are not
+     * visited. */
+    void scan_tree_values(
+        const promql::LabelMatcher& matcher, uint64_t start, uint64_t end,
+        const std::set<unsigned int>& seg_mask,
+        const std::function<void(const TreeValue&, unsigned int)>& fn);
+
+    /* Check if a label name may have pages of a type that overlap the time
+     * range and the segments. */
+    bool has_page_type(const std::string& name, TreePageType type,
+                       uint64_t start, uint64_t end,
+                       const std::set<unsigned int>& seg_mask);
+    bool has_bitmap_pages(const std::string& name, uint64_t start,
+                          uint64_t end, const std::set<unsigned int>& seg_mask)
+    {
+        return has_page_type(name, TreePageType::BITMAP, start, end,
+                             seg_mask) ||
+               has_page_type(name, TreePageType::ROARING, start, end,
+                             seg_mask) ||
+               has_page_type(name, TreePageType::INLINE, start, end,
+                             seg_mask);
+    }
 
-    KeyType make_key(const std::string& name, const std::string& value,
+    KeyType make_key(SymbolTable::Ref name_ref, const std::string& value,
                      uint64_t start_time, unsigned int segsel);
+    static bool is_presence_key(const KeyType& key);
+    static TreePageType get_page_type(const TreeValue& val);
+    /* Add the postings stored in an inline tree value of a segment. */
+    void get_inline_postings(const TreeValue& val, unsigned int segsel,
+                             Roaring& postings);
+
+    void
+    get_regex_key_ranges(SymbolTable::Ref name_ref,
+                         const std::vector<RegexLiteral>& literals,
+                         uint64_t end,
+                         std::vector<std::pair<KeyType, KeyType>>& ranges);
 
-    void _hash_string_name(const std::string& str, uint8_t* out);
     void _hash_string_value(const std::string& str, uint8_t* out);
     void _hash_segsel(unsigned int segsel, uint8_t* out);
 
@@ -0,0 +1,129 @@
+#ifndef _TAGTREE_LABEL_CATALOG_H_
+#define _TAGTREE_LABEL_CATALOG_H_
+
+#include "tagtree/series/symbol_table.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace tagtree {
+
+/* Persistent catalog of the label names and values written to the index tree
+ * with the time range each label pair covers. */
+class LabelCatalog {
+public:
+    LabelCatalog(std::string_view filename);
+    ~LabelCatalog();
+
+    void add(SymbolTable::Ref name_ref, SymbolTable::Ref value_ref,
+             uint64_t min_timestamp, uint64_t max_timestamp);
+
+    /* Get the names (values of a name) that have postings in [start, end]. */
+    void get_names(uint64_t start, uint64_t end,
+                   std::vector<SymbolTable::Ref>& names);
+    void get_values(SymbolTable::Ref name_ref, uint64_t start, uint64_t end,
+                    std::vector<SymbolTable::Ref>& values);
+
+    /* Record that the tree has posting pages of a type for a label name with
+     * postings in the time range and the segment range. */
+    void add_page_type(SymbolTable::Ref name_ref, uint32_t type,
+                       uint64_t min_timestamp, uint64_t max_timestamp,
+                       uint32_t min_segsel, uint32_t max_segsel);
+    /* Check if the tree may have pages of a type for a label name that
+     * overlap [start, end] and [min_segsel, max_segsel]. Names that are not
+     * recorded may have pages of any type. */
+    bool has_page_type(SymbolTable::Ref name_ref, uint32_t type,
+                       uint64_t start, uint64_t end, uint32_t min_segsel,
+                       uint32_t max_segsel);
+
+    /* Get the time range covered by all labels. Return false if the catalog
+     * is empty. */
+    bool get_time_range(uint64_t& min_timestamp, uint64_t& max_timestamp);
+
+    void flush();
+
+private:
+    static const uint32_t MAGIC = 0x4c43544c;
+
+    /* | name ref | value ref | min timestamp | max timestamp | */
+    static const size_t RECORD_SIZE =
+        2 * sizeof(SymbolTable::Ref) + 2 * sizeof(uint64_t);
+
+    /* page type records are | name ref | type | min | max | with a flag in
+     * the MSBs of min telling whether the range is in time or segments */
+    static const uint64_t PAGE_TIME_RECORD_FLAG = 1ULL << 63;
+    static const uint64_t PAGE_SEGMENT_RECORD_FLAG = 1ULL << 62;
+    static const uint64_t RECORD_FLAG_MASK =
+        PAGE_TIME_RECORD_FLAG | PAGE_SEGMENT_RECORD_FLAG;
+
+    /* the file is rewritten when it holds more than COMPACT_RATIO records per
+     * live record and at least COMPACT_MIN_RECORDS records */
+    static const size_t COMPACT_RATIO = 4;
+    static const size_t COMPACT_MIN_RECORDS = 4096;
+
+    struct TimeRange {
+        uint64_t min_timestamp, max_timestamp;
+
+        TimeRange() : min_timestamp(UINT64_MAX), max_timestamp(0) {}
+
+        bool update(uint64_t min_ts, uint64_t max_ts)
+        {
+            if (min_ts >= min_timestamp && max_ts <= max_timestamp)
+                return false;
+
+            min_timestamp = std::min(min_timestamp, min_ts);
+            max_timestamp = std::max(max_timestamp, max_ts);
+            return true;
+        }
+
+        bool overlaps(uint64_t start, uint64_t end) const
+        {
+            return min_timestamp <= end && max_timestamp >= start;
+        }
+    };
+
+    struct PageTypeEntry {
+        TimeRange range;
+        /* range of the segments, kept in a TimeRange */
+        TimeRange segments;
+    };
+
+    struct NameEntry {
+        TimeRange range;
+        std::map<SymbolTable::Ref, TimeRange> values;
+        std::map<uint32_t, PageTypeEntry> page_types;
+    };
+
+    int fd;
+    std::string filename;
+    /* number of records in the file */
+    size_t num_records;
+    std::unordered_map<SymbolTable::Ref, NameEntry> names;
+    std::vector<std::pair<SymbolTable::Ref, SymbolTable::Ref>> dirty;
+    std::vector<std::pair<SymbolTable::Ref, uint32_t>> dirty_page_types;
+    std::shared_mutex mutex;
+
+    void open_catalog();
+    void create_catalog();
+    void load_catalog();
+    /* Write the live records to a new file and replace the catalog with it. */
+    void compact();
+    size_t get_live_records() const;
+
+    static void put_record(uint8_t*& p, SymbolTable::Ref name_ref,
+                           uint32_t ref, uint64_t min, uint64_t max);
+
+    void update(SymbolTable::Ref name_ref, SymbolTable::Ref value_ref,
+                uint64_t min_timestamp, uint64_t max_timestamp,
+                bool mark_dirty);
+};
+
+} // namespace tagtree
+
+#endif
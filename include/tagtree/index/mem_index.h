@@ -31,6 +31,13 @@ struct LabeledPostings {
 using MemIndexSnapshot =
     std::unordered_map<std::string, std::vector<LabeledPostings>>;
 
+/* negative matchers only remove series from the result */
+inline bool is_negative_matcher(const promql::LabelMatcher& matcher)
+{
+    return matcher.op == promql::MatchOp::NEQ ||
+           matcher.op == promql::MatchOp::NEQ_REGEX;
+}
+
 class alignas(64) MemStripe {
 public:
     void reserve(size_t capacity) { map.reserve(capacity); }
@@ -43,8 +50,12 @@ public:
     void resolve_label_matcher(const promql::LabelMatcher& matcher,
                                MemPostingList& tsids, MemPostingList* exclude,
                                bool first);
-    void label_values(const std::string& label_name,
-                      std::unordered_set<std::string>& values);
+    void label_values(const std::string& label_name, uint64_t start,
+                      uint64_t end, std::unordered_set<std::string>& values);
+    void label_names(uint64_t start, uint64_t end,
+                     std::unordered_set<std::string>& names);
+
+    size_t estimate_postings(const promql::LabelMatcher& matcher);
 
     uint64_t snapshot(TSID limit, MemIndexSnapshot& snapshot);
     void gc(TSID low_watermark);
@@ -55,11 +66,14 @@ private:
                            std::unordered_map<std::string, MemPostings>>;
 
     MemMapType map;
+    /* total number of postings of each label name */
+    std::unordered_map<std::string, size_t> name_postings;
     std::atomic<uint64_t> max_timestamp;
     std::shared_mutex mutex;
 
     struct __Inner {
         MemMapType __map;
+        std::unordered_map<std::string, size_t> __name_postings;
         std::atomic<uint64_t> __max_timestamp;
         std::shared_mutex __mutex;
     };
@@ -67,6 +81,10 @@ private:
 
     void get_matcher_postings(const promql::LabelMatcher& matcher,
                               MemPostingList& tsids);
+    void get_regex_postings(
+        const promql::LabelMatcher& matcher,
+        const std::unordered_map<std::string, MemPostings>& value_map,
+        MemPostingList& tsids);
 };
 
 class MemIndex {
@@ -82,8 +100,14 @@ public:
     resolve_label_matchers(const std::vector<promql::LabelMatcher>& matchers,
                            MemPostingList& tsids);
 
-    void label_values(const std::string& label_name,
-                      std::unordered_set<std::string>& values);
+    void label_values(const std::string& label_name, uint64_t start,
+                      uint64_t end, std::unordered_set<std::string>& values);
+    void label_names(uint64_t start, uint64_t end,
+                     std::unordered_set<std::string>& names);
+
+    /* Estimate the number of series matched by a positive matcher. Exact
+     * for EQL, the number of postings of the label name otherwise. */
+    size_t estimate_postings(const promql::LabelMatcher& matcher);
 
     void set_low_watermark(TSID wm, bool force = false);
     uint64_t snapshot(TSID limit, MemIndexSnapshot& snapshot);
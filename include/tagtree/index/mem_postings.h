@@ -16,14 +16,16 @@ struct MemPostings {
 
     MemPostings() : min_timestamp(UINT64_MAX), next_timestamp(UINT64_MAX) {}
 
-    void add(TSID tsid, uint64_t timestamp, bool set_next)
+    bool add(TSID tsid, uint64_t timestamp, bool set_next)
     {
-        bitmap.add(tsid);
+        bool added = bitmap.addChecked(tsid);
 
         if (set_next)
             next_timestamp = std::min(next_timestamp, timestamp);
         else
             min_timestamp = std::min(min_timestamp, timestamp);
+
+        return added;
     }
 };
 
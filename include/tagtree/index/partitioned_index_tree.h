@@ -0,0 +1,99 @@
+#ifndef _TAGTREE_PARTITIONED_INDEX_TREE_H_
+#define _TAGTREE_PARTITIONED_INDEX_TREE_H_
+
+#include "tagtree/index/fetch_worker_pool.h"
+#include "tagtree/index/index_tree.h"
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+namespace tagtree {
+
+class IndexServer;
+
+/* Index trees partitioned by time. Each compaction is written to the
+ * partition of its flush time so that all postings of a series from one
+ * snapshot live in the same tree. A partition is stored in its own file and
+ * covers the time range of the postings written to it. The cache budget is
+ * split among the partitions and the fetch workers are shared. */
+class PartitionedIndexTree {
+public:
+    static const uint64_t DEFAULT_PARTITION_DURATION = 24 * 3600 * 1000ULL;
+    static constexpr unsigned int MAX_FETCH_WORKERS = 4;
+    /* smallest cache of a partition in pages */
+    static constexpr size_t MIN_PARTITION_CACHE_SIZE = 64;
+
+    PartitionedIndexTree(IndexServer* server, std::string_view index_dir,
+                         size_t cache_size, bool bitmap_only,
+                         uint64_t partition_duration);
+
+    void write_postings(TSID limit, MemIndexSnapshot& snapshot);
+
+    void
+    resolve_label_matchers(const std::vector<promql::LabelMatcher>& matchers,
+                           uint64_t start, uint64_t end, Roaring& postings);
+    std::unique_ptr<PostingsIterator>
+    get_postings(const std::vector<promql::LabelMatcher>& matchers,
+                 uint64_t start, uint64_t end);
+
+    void label_values(const std::string& label_name, uint64_t start,
+                      uint64_t end, std::unordered_set<std::string>& values);
+    void label_names(uint64_t start, uint64_t end,
+                     std::unordered_set<std::string>& names);
+
+    size_t estimate_postings(const promql::LabelMatcher& matcher);
+    size_t
+    estimate_cardinality(const std::vector<promql::LabelMatcher>& matchers,
+                         uint64_t start, uint64_t end);
+
+    /* Delete the partitions that only have postings before timestamp.
+     * Return the number of partitions deleted. */
+    size_t drop_partitions(uint64_t timestamp);
+
+    /* Increased by every write_postings() and drop_partitions(). */
+    unsigned int get_version() const { return version.load(); }
+
+private:
+    struct Partition {
+        std::shared_ptr<IndexTree> tree;
+        std::string filename;
+        uint64_t min_timestamp, max_timestamp;
+
+        bool overlaps(uint64_t start, uint64_t end) const
+        {
+            return min_timestamp <= end && max_timestamp >= start;
+        }
+    };
+
+    IndexServer* server;
+    std::string index_dir;
+    size_t cache_size;
+    bool bitmap_only;
+    uint64_t partition_duration;
+    std::shared_ptr<FetchWorkerPool> fetch_pool;
+
+    /* partitions indexed by the start of their time bucket */
+    std::map<uint64_t, Partition> partitions;
+    std::shared_mutex mutex;
+    std::atomic<unsigned int> version;
+
+    std::string get_partition_filename(uint64_t bucket);
+    void open_partitions();
+    Partition& open_partition(uint64_t bucket, size_t num_partitions);
+
+    /* Share of the cache budget of each of num_partitions partitions. */
+    size_t get_partition_cache_size(size_t num_partitions) const;
+    /* Resize the node caches of the partitions to their current share. */
+    void rebalance_caches();
+
+    void get_trees(uint64_t start, uint64_t end,
+                   std::vector<std::shared_ptr<IndexTree>>& trees);
+};
+
+} // namespace tagtree
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef _TAGTREE_POSTINGS_H_
+#define _TAGTREE_POSTINGS_H_
+
+#include "tagtree/index/mem_index.h"
+#include "tagtree/tsid.h"
+
+#include "roaring.hh"
+
+#include <memory>
+
+namespace tagtree {
+
+/* Pull-based iterator over TSIDs in ascending order. The iterator is
+ * positioned before the first TSID when created. */
+class PostingsIterator {
+public:
+    virtual ~PostingsIterator() {}
+
+    /* Advance to the next TSID. Return false if the postings are exhausted. */
+    virtual bool next() = 0;
+    /* Advance to the first TSID >= tsid. Never moves backwards. */
+    virtual bool seek(TSID tsid) = 0;
+    virtual TSID at() const = 0;
+};
+
+class RoaringPostingsIterator : public PostingsIterator {
+public:
+    explicit RoaringPostingsIterator(MemPostingList postings);
+
+    virtual bool next();
+    virtual bool seek(TSID tsid);
+    virtual TSID at() const { return *it; }
+
+private:
+    MemPostingList postings;
+    RoaringSetBitForwardIterator it;
+    bool started;
+};
+
+/* Union of two postings iterators. */
+class MergedPostingsIterator : public PostingsIterator {
+public:
+    MergedPostingsIterator(std::unique_ptr<PostingsIterator> a,
+                           std::unique_ptr<PostingsIterator> b);
+
+    virtual bool next();
+    virtual bool seek(TSID tsid);
+    virtual TSID at() const { return cur; }
+
+private:
+    std::unique_ptr<PostingsIterator> a, b;
+    bool a_valid, b_valid;
+    bool started;
+    TSID cur;
+
+    bool update();
+};
+
+} // namespace tagtree
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef _TAGTREE_REGEX_LITERALS_H_
+#define _TAGTREE_REGEX_LITERALS_H_
+
+#include <string>
+#include <vector>
+
+namespace tagtree {
+
+struct RegexLiteral {
+    std::string literal;
+    bool exact; /* the value must be equal to the literal */
+
+    RegexLiteral(const std::string& literal, bool exact)
+        : literal(literal), exact(exact)
+    {}
+};
+
+/* Extract the literal prefix of every alternative of a (fully anchored) label
+ * matcher regex, e.g. "foo-.*" -> {"foo-"}, "prod|staging" -> {"prod"(exact),
+ * "staging"(exact)}. Any value matched by the regex starts with (or is equal
+ * to) one of the literals. Returns false if some alternative has no literal
+ * prefix. */
+bool extract_regex_literals(const std::string& regex,
+                            std::vector<RegexLiteral>& literals);
+
+/* Check if a value can be matched by a regex with the given literals. */
+bool match_regex_literals(const std::string& value,
+                          const std::vector<RegexLiteral>& literals);
+
+} // namespace tagtree
+
+#endif
@@ -10,6 +10,10 @@
 #include <emmintrin.h>
 #include <smmintrin.h>
 
+#ifdef _TAGTREE_USE_AVX2_
+#include <immintrin.h>
+#endif
+
 namespace tagtree {
 
 namespace detail {
@@ -24,11 +28,17 @@ template <int N, int align> constexpr int roundup()
 
 }; // namespace detail
 
+/* Key of | name | value | start timestamp | segment number |. The timestamp
+ * is stored in big-endian order and the segment number is complemented so
+ * that the keys are ordered by their bytes with larger segment numbers
+ * first. */
 template <size_t NB, size_t VB> class TupleKey {
     friend class std::hash<TupleKey<NB, VB>>;
 
 public:
-    static const size_t KEY_LENGTH = NB + VB + 8 + 4;
+    static const size_t TIMESTAMP_OFFSET = NB + VB;
+    static const size_t SEGNUM_OFFSET = TIMESTAMP_OFFSET + 8;
+    static const size_t KEY_LENGTH = SEGNUM_OFFSET + 4;
 
     TupleKey() { ::memset(buf, 0, sizeof(buf)); }
     TupleKey(const uint8_t* data)
@@ -41,10 +51,22 @@ public:
 
     void get_tag_name(uint8_t* data) const { ::memcpy(data, buf, NB); }
     void get_tag_value(uint8_t* data) const { ::memcpy(data, &buf[NB], VB); }
-    uint64_t get_timestamp() const { return *(uint64_t*)&buf[NB + VB]; }
+    uint64_t get_timestamp() const
+    {
+        return __builtin_bswap64(*(uint64_t*)&buf[TIMESTAMP_OFFSET]);
+    }
     unsigned int get_segnum() const
     {
-        return *(unsigned int*)&buf[NB + VB + 8];
+        return ~__builtin_bswap32(*(uint32_t*)&buf[SEGNUM_OFFSET]);
+    }
+
+    /* first 8 bytes of the key as a big-endian integer, ordered like the
+     * keys */
+    uint64_t get_prefix() const
+    {
+        uint64_t prefix;
+        ::memcpy(&prefix, buf, sizeof(prefix));
+        return __builtin_bswap64(prefix);
     }
 
     void clear_tag_name() { ::memset(buf, 0, NB); }
@@ -54,11 +76,63 @@ public:
     void set_tag_value(uint8_t* data) { ::memcpy(&buf[NB], data, VB); }
     void set_timestamp(uint64_t timestamp)
     {
-        *(uint64_t*)&buf[NB + VB] = timestamp;
+        *(uint64_t*)&buf[TIMESTAMP_OFFSET] = __builtin_bswap64(timestamp);
     }
     void set_segnum(unsigned int seg)
     {
-        *(unsigned int*)&buf[NB + VB + 8] = seg;
+        *(uint32_t*)&buf[SEGNUM_OFFSET] = __builtin_bswap32(~(uint32_t)seg);
+    }
+
+    /* Smallest and largest keys that share the first len bytes with the
+     * key. */
+    TupleKey<NB, VB> first_with_prefix(size_t len) const
+    {
+        TupleKey<NB, VB> key(*this);
+        ::memset(&key.buf[len], 0, KEY_LENGTH - len);
+        return key;
+    }
+    TupleKey<NB, VB> last_with_prefix(size_t len) const
+    {
+        TupleKey<NB, VB> key(*this);
+        ::memset(&key.buf[len], 0xff, KEY_LENGTH - len);
+        return key;
+    }
+
+    /* Compare the keys by their bytes. */
+    int compare(const TupleKey<NB, VB>& rhs) const
+    {
+#ifdef _TAGTREE_USE_AVX2_
+        if constexpr (BUF_LENGTH % 32 == 0) {
+            for (size_t i = 0; i < BUF_LENGTH; i += 32) {
+                __m256i a, b;
+                a = _mm256_loadu_si256((__m256i*)&buf[i]);
+                b = _mm256_loadu_si256((__m256i*)&rhs.buf[i]);
+                uint32_t neq = ~(uint32_t)_mm256_movemask_epi8(
+                    _mm256_cmpeq_epi8(a, b));
+
+                if (neq) {
+                    auto j = i + __builtin_ctz(neq);
+                    return (int)buf[j] - (int)rhs.buf[j];
+                }
+            }
+
+            return 0;
+        }
+#endif
+
+        for (size_t i = 0; i < BUF_LENGTH; i += 16) {
+            __m128i a, b;
+            a = _mm_loadu_si128((__m128i*)&buf[i]);
+            b = _mm_loadu_si128((__m128i*)&rhs.buf[i]);
+            uint32_t neq = ~_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & 0xffff;
+
+            if (neq) {
+                auto j = i + __builtin_ctz(neq);
+                return (int)buf[j] - (int)rhs.buf[j];
+            }
+        }
+
+        return 0;
     }
 
     bool operator==(const TupleKey<NB, VB>& rhs) const
@@ -80,36 +154,12 @@ public:
 
     bool operator<(const TupleKey<NB, VB>& rhs) const
     {
-        auto name_cmp = memcmp(buf, rhs.buf, NB);
-        auto value_cmp = memcmp(&buf[NB], &rhs.buf[NB], VB);
-
-        if (name_cmp < 0) return true;
-        if (name_cmp > 0) return false;
-
-        if (value_cmp < 0) return true;
-        if (value_cmp > 0) return false;
-
-        if (get_timestamp() < rhs.get_timestamp()) return true;
-        if (get_timestamp() > rhs.get_timestamp()) return false;
-
-        return get_segnum() > rhs.get_segnum();
+        return compare(rhs) < 0;
     }
 
     bool operator>(const TupleKey<NB, VB>& rhs) const
     {
-        auto name_cmp = memcmp(buf, rhs.buf, NB);
-        auto value_cmp = memcmp(&buf[NB], &rhs.buf[NB], VB);
-
-        if (name_cmp > 0) return true;
-        if (name_cmp < 0) return false;
-
-        if (value_cmp > 0) return true;
-        if (value_cmp < 0) return false;
-
-        if (get_timestamp() > rhs.get_timestamp()) return true;
-        if (get_timestamp() < rhs.get_timestamp()) return false;
-
-        return get_segnum() < rhs.get_segnum();
+        return compare(rhs) > 0;
     }
 
     bool operator>=(const TupleKey<NB, VB>& rhs) const
@@ -126,7 +176,8 @@ public:
         std::stringstream ss;
         ss << std::hex << std::setfill('0');
         for (int i = 0; i < KEY_LENGTH; ++i) {
-            if (i == NB || i == NB + VB || i == NB + VB + 8) ss << '|';
+            if (i == NB || i == TIMESTAMP_OFFSET || i == SEGNUM_OFFSET)
+                ss << '|';
             ss << std::setw(2) << static_cast<unsigned>(buf[i]);
         }
         return ss.str();
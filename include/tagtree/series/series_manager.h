@@ -88,6 +88,10 @@ public:
     {
         return symtab.add_symbol(symbol);
     }
+    bool find_symbol(std::string_view symbol, SymbolTable::Ref& ref)
+    {
+        return symtab.find_symbol(symbol, ref);
+    }
     const std::string& get_symbol(SymbolTable::Ref ref)
     {
         return symtab.get_symbol(ref);
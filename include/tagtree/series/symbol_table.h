@@ -1,6 +1,7 @@
 #ifndef _TAGTREE_SYMBOL_TABLE_H_
 #define _TAGTREE_SYMBOL_TABLE_H_
 
+#include <mutex>
 #include <shared_mutex>
 #include <unordered_map>
 #include <vector>
@@ -15,6 +16,9 @@ public:
     ~SymbolTable();
 
     Ref add_symbol(std::string_view symbol);
+    /* Get the ref of a symbol without adding it. Return false if the symbol
+     * does not exist. */
+    bool find_symbol(std::string_view symbol, Ref& ref);
     const std::string& get_symbol(Ref ref);
 
     void flush();
@@ -2,6 +2,7 @@
 #define _TAGTREE_STORAGE_H_
 
 #include "tagtree/index/mem_index.h"
+#include "tagtree/index/postings.h"
 #include "tagtree/tsid.h"
 
 #include <cstdint>
@@ -32,6 +33,20 @@ public:
 class Querier {
 public:
     virtual std::shared_ptr<SeriesSet> select(const MemPostingList& tsids) = 0;
+
+    /* Select the series produced by a postings iterator. Storages that can
+     * consume the TSIDs as they are produced should override this. */
+    virtual std::shared_ptr<SeriesSet>
+    select(std::unique_ptr<PostingsIterator> postings)
+    {
+        MemPostingList tsids;
+
+        while (postings->next()) {
+            tsids.add(postings->at());
+        }
+
+        return select(tsids);
+    }
 };
 
 class Queryable {
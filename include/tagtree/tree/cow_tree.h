@@ -6,15 +6,34 @@
 
 #include "CRC.h"
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <shared_mutex>
+#include <stdexcept>
 #include <unordered_map>
 
 namespace tagtree {
 
 class TransactionAborted : public std::exception {};
 
+/* Largest fanout with which both leaf and inner nodes fit in a page:
+ *
+ * | tag | size | keys | values | and | tag | size | keys | child pages |
+ */
+template <size_t PageSize, typename K, typename V>
+constexpr unsigned int cow_tree_fanout()
+{
+    constexpr size_t header = 2 * sizeof(uint32_t);
+    constexpr size_t leaf = (PageSize - header) / (sizeof(K) + sizeof(V));
+    constexpr size_t inner = (PageSize - header - sizeof(bptree::PageID)) /
+                             (sizeof(K) + sizeof(bptree::PageID));
+
+    return std::min(leaf, inner);
+}
+
 template <unsigned int N, typename K, typename V, typename KeySerializer,
           typename KeyComparator, typename KeyEq, typename ValueSerializer>
 class BaseCOWNode;
@@ -40,6 +59,31 @@ public:
     using BaseNodeType = BaseCOWNode<N, K, V, KeySerializer, KeyComparator,
                                      KeyEq, ValueSerializer>;
 
+    /* An entry of a bulk merge. Updates replace the value with an equal key
+     * that is bytewise equal to old_value and are dropped if there is none,
+     * so old_value should identify a single value of the key. Entries are
+     * sorted by key with the updates of a key before its inserts. */
+    struct MergeEntry {
+        K key;
+        V value;
+        bool update;
+        V old_value;
+
+        MergeEntry(const K& key, const V& value)
+            : key(key), value(value), update(false)
+        {}
+        MergeEntry(const K& key, const V& value, const V& old_value)
+            : key(key), value(value), update(true), old_value(old_value)
+        {}
+
+        bool operator<(const MergeEntry& rhs) const
+        {
+            if (KeyComparator{}(key, rhs.key)) return true;
+            if (KeyComparator{}(rhs.key, key)) return false;
+            return update && !rhs.update;
+        }
+    };
+
     class Transaction {
         friend TreeType;
 
@@ -58,14 +102,66 @@ public:
             return new_node;
         }
 
+        /* Mark a page that is not reachable from the new version. */
+        void retire_page(bptree::PageID pid) { retired_pages.push_back(pid); }
+        const std::vector<bptree::PageID>& get_retired_pages() const
+        {
+            return retired_pages;
+        }
+
     private:
         TreeType* tree;
         Version old_version;
         std::shared_ptr<BaseNodeType> new_root;
         std::vector<std::shared_ptr<BaseNodeType>> new_nodes;
+        std::vector<bptree::PageID> retired_pages;
+    };
+
+    /* Keep a version readable while the pin is held. */
+    class VersionPin {
+    public:
+        VersionPin() : tree(nullptr), version(0) {}
+        VersionPin(TreeType* tree, Version version = LATEST_VERSION)
+            : tree(tree), version(tree->pin_version(version))
+        {}
+        VersionPin(const VersionPin& rhs)
+            : tree(rhs.tree),
+              version(rhs.tree ? rhs.tree->pin_version(rhs.version) : 0)
+        {}
+        VersionPin(VersionPin&& rhs) : tree(rhs.tree), version(rhs.version)
+        {
+            rhs.tree = nullptr;
+        }
+        ~VersionPin() { reset(); }
+
+        VersionPin& operator=(VersionPin rhs)
+        {
+            std::swap(tree, rhs.tree);
+            std::swap(version, rhs.version);
+            return *this;
+        }
+
+        void reset()
+        {
+            if (tree) tree->unpin_version(version);
+            tree = nullptr;
+        }
+
+        Version get_version() const { return version; }
+
+    private:
+        TreeType* tree;
+        Version version;
     };
 
-    COWTree(bptree::AbstractPageCache* page_cache) : page_cache(page_cache)
+    /* Clean nodes are kept in memory up to node_cache_size bytes. The node
+     * cache is unbounded if node_cache_size is 0. The format version of the
+     * keys and values is stored in the metadata and an existing tree with
+     * another version is rejected. */
+    COWTree(bptree::AbstractPageCache* page_cache, size_t node_cache_size = 0,
+            uint32_t format_version = 0)
+        : page_cache(page_cache), format_version(format_version),
+          node_cache_size(node_cache_size), node_cache_bytes(0), clock_hand(0)
     {
         auto created = !read_metadata();
 
@@ -106,10 +202,23 @@ public:
     void get_value(const K& key, std::vector<V>& value_list,
                    Version version = LATEST_VERSION)
     {
+        using InnerNodeType = InnerCOWNode<N, K, V, KeySerializer,
+                                           KeyComparator, KeyEq,
+                                           ValueSerializer>;
+
         typename BaseNodeType::ValueListIterator value_first = nullptr,
                                                  value_last = nullptr;
-        auto* root = get_read_tree(version);
-        root->get_values(key, false, nullptr, nullptr, nullptr, value_first,
+        VersionPin pin(this, version);
+        auto node = get_read_tree(pin.get_version());
+
+        /* hold the leaf until the values are copied */
+        while (!node->is_leaf()) {
+            auto* inner = static_cast<InnerNodeType*>(node.get());
+            node = inner->get_child(inner->find_child(key));
+            if (!node) return;
+        }
+
+        node->get_values(key, false, nullptr, nullptr, nullptr, value_first,
                          value_last);
         value_list.assign(value_first, value_last);
     }
@@ -135,8 +244,8 @@ public:
             new_root->keys[0] = split_key;
             new_root->child_pages[0] = root->get_pid();
             new_root->child_pages[1] = right_sibling->get_pid();
-            new_root->child_cache[0] = std::move(root);
-            new_root->child_cache[1] = std::move(right_sibling);
+            new_root->child_cache[0] = root;
+            new_root->child_cache[1] = right_sibling;
 
             root = std::move(new_root);
         }
@@ -161,6 +270,46 @@ public:
         return updated;
     }
 
+    /* Merge a run of entries sorted by key into the tree in one pass. Only
+     * the nodes on the paths to the affected leaves are rebuilt and nodes
+     * split by the merge are filled evenly. */
+    void bulk_merge(const std::vector<MergeEntry>& entries, Transaction& txn)
+    {
+        using InnerNodeType = InnerCOWNode<N, K, V, KeySerializer,
+                                           KeyComparator, KeyEq,
+                                           ValueSerializer>;
+
+        if (entries.empty()) return;
+
+        assert(std::is_sorted(entries.begin(), entries.end()));
+
+        typename BaseNodeType::MergeResult nodes;
+        txn.new_root->merge_values(txn, &entries[0],
+                                   &entries[0] + entries.size(), nodes);
+
+        if (!nodes.front().second) nodes.front().second = txn.new_root;
+
+        /* add levels above the root until one node is left */
+        while (nodes.size() > 1) {
+            std::vector<K> keys;
+            std::vector<bptree::PageID> pages;
+            std::vector<std::shared_ptr<BaseNodeType>> cache;
+
+            for (size_t i = 0; i < nodes.size(); i++) {
+                if (i > 0) keys.push_back(nodes[i].first);
+                pages.push_back(nodes[i].second->get_pid());
+                cache.push_back(std::move(nodes[i].second));
+            }
+
+            nodes.clear();
+            InnerNodeType::build_nodes(txn, nullptr, nullptr, keys, pages,
+                                       cache, nodes);
+        }
+
+        txn.new_root = std::move(nodes.front().second);
+        txn.new_root->set_parent(nullptr);
+    }
+
     void get_write_tree(Transaction& txn)
     {
         auto version = latest_version.load();
@@ -190,6 +339,12 @@ public:
         for (auto&& node : txn.new_nodes) {
             write_node(node.get());
             node->set_new_node(false);
+            node->build_prefixes();
+        }
+
+        /* the new nodes are clean now and owned by the node cache */
+        for (auto&& node : txn.new_nodes) {
+            cache_node(std::move(node));
         }
         txn.new_nodes.clear();
 
@@ -205,6 +360,54 @@ public:
         return latest_version.fetch_add(1) + 1;
     }
 
+    Version pin_version(Version version = LATEST_VERSION)
+    {
+        std::lock_guard<std::mutex> guard(pin_mutex);
+
+        if (version == LATEST_VERSION) version = latest_version.load();
+        pinned_versions[version]++;
+
+        return version;
+    }
+
+    void unpin_version(Version version)
+    {
+        std::lock_guard<std::mutex> guard(pin_mutex);
+
+        auto it = pinned_versions.find(version);
+        assert(it != pinned_versions.end());
+        if (!--it->second) pinned_versions.erase(it);
+    }
+
+    /* Drop the versions that can no longer be read. Return the oldest
+     * version still readable. The version before the latest one is kept
+     * because its metadata may be used for recovery. */
+    Version collect_versions()
+    {
+        Version min_version;
+
+        {
+            std::lock_guard<std::mutex> guard(pin_mutex);
+
+            min_version = latest_version.load();
+            if (min_version > 1) min_version--;
+
+            if (!pinned_versions.empty())
+                min_version =
+                    std::min(min_version, pinned_versions.begin()->first);
+        }
+
+        std::unique_lock<std::shared_mutex> lock(root_mutex);
+        for (auto it = root_map.begin(); it != root_map.end();) {
+            if (it->first < min_version)
+                it = root_map.erase(it);
+            else
+                it++;
+        }
+
+        return min_version;
+    }
+
     std::shared_ptr<BaseNodeType> read_node(BaseNodeType* parent,
                                             bptree::PageID pid)
     {
@@ -255,9 +458,62 @@ public:
         page_cache->unpin_page(page, true, lock);
     }
 
+    /* Keep a clean node in the node cache. If the cache is over budget, the
+     * clock hand evicts the nodes not referenced since its last pass. Nodes
+     * still held elsewhere (roots and nodes used by readers or writers) are
+     * skipped. */
+    void cache_node(std::shared_ptr<BaseNodeType> node)
+    {
+        /* evicted nodes are freed after the lock is released */
+        std::vector<std::shared_ptr<BaseNodeType>> evicted;
+        std::lock_guard<std::mutex> guard(node_cache_mutex);
+
+        node_cache_bytes += node->get_memory_size();
+        if (free_slots.empty()) {
+            node_ring.push_back(std::move(node));
+        } else {
+            node_ring[free_slots.back()] = std::move(node);
+            free_slots.pop_back();
+        }
+
+        if (!node_cache_size) return;
+
+        /* two passes clear all reference bits */
+        for (size_t n = 2 * node_ring.size();
+             n > 0 && node_cache_bytes > node_cache_size; n--) {
+            if (clock_hand >= node_ring.size()) clock_hand = 0;
+            auto& slot = node_ring[clock_hand];
+
+            if (slot && slot->is_referenced()) {
+                slot->set_referenced(false);
+            } else if (slot && slot.use_count() == 1) {
+                node_cache_bytes -= slot->get_memory_size();
+                evicted.push_back(std::move(slot));
+                free_slots.push_back(clock_hand);
+            }
+
+            clock_hand++;
+        }
+    }
+
+    void set_node_cache_size(size_t size)
+    {
+        std::lock_guard<std::mutex> guard(node_cache_mutex);
+        node_cache_size = size;
+    }
+
+    /* memory taken by the nodes in the node cache */
+    size_t get_node_cache_bytes()
+    {
+        std::lock_guard<std::mutex> guard(node_cache_mutex);
+        return node_cache_bytes;
+    }
+
+    Version get_latest_version() const { return latest_version.load(); }
+
     void print(std::ostream& os, Version version = LATEST_VERSION)
     {
-        auto* root = get_read_tree(version);
+        auto root = get_read_tree(version);
         root->print(os);
     }
 
@@ -267,20 +523,6 @@ public:
         return os;
     }
 
-private:
-    void collect_values(Version version, const K& key,
-                        std::optional<K>* next_key,
-                        typename BaseNodeType::KeyListIterator& key_first,
-                        typename BaseNodeType::KeyListIterator& key_last,
-                        typename BaseNodeType::ValueListIterator& value_first,
-                        typename BaseNodeType::ValueListIterator& value_last)
-    {
-        auto* root = get_read_tree(version);
-        root->get_values(key, true, next_key, &key_first, &key_last,
-                         value_first, value_last);
-    }
-
-public:
     /* iterator interface */
     class iterator {
         friend TreeType;
@@ -293,13 +535,12 @@ public:
         using iterator_category = std::forward_iterator_tag;
         using difference_type = int;
 
-        self_type operator++()
+        self_type& operator++()
         {
-            self_type i = *this;
             inc();
-            return i;
+            return *this;
         }
-        self_type operator++(int _unused)
+        self_type& operator++(int _unused)
         {
             inc();
             return *this;
@@ -312,72 +553,103 @@ public:
         bool is_end() const { return ended; }
 
     private:
+        using InnerNodeType = InnerCOWNode<N, K, V, KeySerializer,
+                                           KeyComparator, KeyEq,
+                                           ValueSerializer>;
+
         typename BaseNodeType::KeyListIterator key_first;
         typename BaseNodeType::KeyListIterator key_last;
         typename BaseNodeType::ValueListIterator value_first;
         typename BaseNodeType::ValueListIterator value_last;
         value_type kvp;
-        std::optional<K> next_key;
         bool ended;
         Version version;
         KeyComparator kcmp;
 
         using container_type = TreeType;
         container_type* tree;
+        std::shared_ptr<VersionPin> pin;
+        /* inner nodes on the path to the current leaf with the index of the
+         * child taken at each of them */
+        std::vector<std::pair<std::shared_ptr<InnerNodeType>, size_t>> path;
+        std::shared_ptr<BaseNodeType> leaf;
 
         iterator(container_type* tree, Version version, const K& key,
                  KeyComparator kcmp = KeyComparator{})
-            : tree(tree), kcmp(kcmp), version(version), next_key(std::nullopt)
+            : tree(tree), kcmp(kcmp),
+              pin(std::make_shared<VersionPin>(tree, version))
         {
+            this->version = pin->get_version();
             ended = false;
-            tree->collect_values(version, key, &next_key, key_first, key_last,
-                                 value_first, value_last);
+
+            auto node = tree->get_read_tree(this->version);
+            while (!node->is_leaf()) {
+                auto inner = std::static_pointer_cast<InnerNodeType>(node);
+                size_t idx = inner->find_child(key);
+
+                node = inner->get_child(idx);
+                assert(node);
+                path.emplace_back(std::move(inner), idx);
+            }
+            load_leaf(std::move(node));
 
             auto it = std::lower_bound(key_first, key_last, key, kcmp);
-            if (it == key_last) {
-                get_next_batch();
+            value_first += std::distance(key_first, it);
+            key_first = it;
 
-                if (ended) return;
-                kvp = std::make_pair(*key_first, *value_first);
-            } else {
-                value_first += std::distance(key_first, it);
-                key_first = it;
+            if (key_first == key_last) next_leaf();
+            if (ended) return;
 
-                kvp = std::make_pair(*key_first, *value_first);
-            }
+            kvp = std::make_pair(*key_first, *value_first);
         }
 
         void inc()
         {
             if (ended) return;
-            if (key_first + 1 == key_last) {
-                get_next_batch();
-            } else {
-                key_first++;
-                value_first++;
-            }
+
+            key_first++;
+            value_first++;
+            if (key_first == key_last) next_leaf();
             if (ended) return;
+
             kvp = std::make_pair(*key_first, *value_first);
         }
 
-        void get_next_batch()
+        void load_leaf(std::shared_ptr<BaseNodeType> node)
         {
-            if (!next_key) {
-                ended = true;
-                return;
-            }
+            leaf = std::move(node);
+            leaf->get_values(K{}, true, nullptr, &key_first, &key_last,
+                             value_first, value_last);
+        }
 
-            K key = *next_key;
-            next_key = std::nullopt;
-            tree->collect_values(version, key, &next_key, key_first, key_last,
-                                 value_first, value_last);
-            auto it = std::lower_bound(key_first, key_last, key, kcmp);
-            if (it == key_last) {
-                ended = true;
-            } else {
-                value_first += std::distance(key_first, it);
-                key_first = it;
+        void next_leaf()
+        {
+            /* go up to the first node with a child on the right and down to
+             * the leftmost leaf of that child */
+            while (!path.empty()) {
+                auto& top = path.back();
+
+                if (top.second >= top.first->get_size()) {
+                    path.pop_back();
+                    continue;
+                }
+
+                auto node = top.first->get_child(++top.second);
+                assert(node);
+
+                while (!node->is_leaf()) {
+                    auto inner = std::static_pointer_cast<InnerNodeType>(node);
+
+                    node = inner->get_child(0);
+                    assert(node);
+                    path.emplace_back(std::move(inner), 0);
+                }
+
+                load_leaf(std::move(node));
+                if (key_first != key_last) return;
             }
+
+            ended = true;
         }
     };
 
@@ -411,9 +683,6 @@ private:
 public:
     iterator begin(const K& key, Version version = LATEST_VERSION)
     {
-        if (version == LATEST_VERSION) {
-            version = latest_version.load();
-        }
         return iterator(this, version, key);
     }
     Sentinel end() const { return Sentinel{}; }
@@ -426,14 +695,26 @@ private:
     static const uint32_t LEAF_TAG = 2;
 
     bptree::AbstractPageCache* page_cache;
+    uint32_t format_version;
     std::atomic<Version> latest_version;
     using RootMapType =
         std::unordered_map<Version, std::shared_ptr<BaseNodeType>>;
     RootMapType root_map;
     std::shared_mutex root_mutex;
+    std::map<Version, unsigned int> pinned_versions;
+    std::mutex pin_mutex;
     int metadata_index; // for double write
 
-    BaseNodeType* get_read_tree(Version version)
+    /* CLOCK ring of the clean nodes. Inner nodes only hold weak references to
+     * their children so an evicted node is freed when no one uses it. */
+    size_t node_cache_size;
+    size_t node_cache_bytes;
+    std::vector<std::shared_ptr<BaseNodeType>> node_ring;
+    std::vector<size_t> free_slots;
+    size_t clock_hand;
+    std::mutex node_cache_mutex;
+
+    std::shared_ptr<BaseNodeType> get_read_tree(Version version)
     {
         if (version == LATEST_VERSION) {
             version = latest_version.load();
@@ -445,10 +726,16 @@ private:
             it = root_map.find(version);
         }
 
-        return it->second.get();
+        return it->second;
     }
 
-    /* metadata: | magic(4 bytes) | root page id(4 bytes) | */
+    /* metadata: | magic(4 bytes) | 2 x (version | root page id | crc) |
+     *            format version(4 bytes) | */
+    static const size_t METADATA_SIZE =
+        sizeof(uint32_t) + sizeof(bptree::PageID);
+    static const size_t FORMAT_VERSION_OFFSET =
+        sizeof(uint32_t) + 2 * (METADATA_SIZE + sizeof(uint32_t));
+
     bool read_metadata()
     {
         boost::upgrade_lock<bptree::Page> lock;
@@ -457,22 +744,28 @@ private:
 
         const auto* buf = page->get_buffer(lock);
         auto magic = *reinterpret_cast<const uint32_t*>(buf);
+        auto stored_version =
+            *reinterpret_cast<const uint32_t*>(buf + FORMAT_VERSION_OFFSET);
         buf += sizeof(uint32_t);
 
         if (magic != META_PAGE_MAGIC) {
             return false;
         }
 
+        if (stored_version != format_version) {
+            page_cache->unpin_page(page, false, lock);
+            throw std::runtime_error(
+                "unsupported tree format version, rebuild the index");
+        }
+
         latest_version.store(0, std::memory_order_relaxed);
 
         bool ok = false;
         metadata_index = 0;
         for (int i = 0; i < 2; i++) {
-            const auto metadata_size =
-                sizeof(uint32_t) + sizeof(bptree::PageID);
-            uint32_t crc = CRC::Calculate(buf, metadata_size, CRC::CRC_32());
+            uint32_t crc = CRC::Calculate(buf, METADATA_SIZE, CRC::CRC_32());
             uint32_t crc_read =
-                *reinterpret_cast<const uint32_t*>(buf + metadata_size);
+                *reinterpret_cast<const uint32_t*>(buf + METADATA_SIZE);
 
             if (crc != crc_read) {
                 continue;
@@ -515,19 +808,18 @@ private:
             if (magic != META_PAGE_MAGIC) {
                 *reinterpret_cast<uint32_t*>(buf) = META_PAGE_MAGIC;
             }
+            *reinterpret_cast<uint32_t*>(buf + FORMAT_VERSION_OFFSET) =
+                format_version;
             buf += sizeof(uint32_t);
 
-            const auto metadata_size =
-                sizeof(uint32_t) + sizeof(bptree::PageID);
-
-            buf += metadata_index * (metadata_size + sizeof(uint32_t));
+            buf += metadata_index * (METADATA_SIZE + sizeof(uint32_t));
             const uint8_t* mdp = buf;
             *reinterpret_cast<uint32_t*>(buf) = version;
             buf += sizeof(uint32_t);
             *reinterpret_cast<bptree::PageID*>(buf) = root_pid;
             buf += sizeof(bptree::PageID);
             *reinterpret_cast<uint32_t*>(buf) =
-                CRC::Calculate(mdp, metadata_size, CRC::CRC_32());
+                CRC::Calculate(mdp, METADATA_SIZE, CRC::CRC_32());
 
             metadata_index = 1 - metadata_index;
         }
@@ -5,10 +5,35 @@
 #include "bptree/serializer.h"
 #include "tagtree/tree/cow_tree.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <climits>
+#include <cstring>
 #include <optional>
+#include <type_traits>
+#include <vector>
+
+#ifdef _TAGTREE_USE_AVX2_
+#include <immintrin.h>
+#endif
 
 namespace tagtree {
 
+namespace detail {
+
+/* Keys with an order-preserving 64-bit prefix (a.get_prefix() <
+ * b.get_prefix() implies a < b) are searched on the prefixes first. */
+template <typename K, typename = void>
+struct has_key_prefix : std::false_type {};
+
+template <typename K>
+struct has_key_prefix<
+    K, std::void_t<decltype(std::declval<const K&>().get_prefix())>>
+    : std::true_type {};
+
+}; // namespace detail
+
 template <unsigned int N, typename K, typename V, typename KeySerializer,
           typename KeyComparator, typename KeyEq, typename ValueSerializer>
 class BaseCOWNode {
@@ -20,11 +45,16 @@ public:
 
     using KeyListIterator = K*;
     using ValueListIterator = V*;
+    using MergeEntry = typename TreeType::MergeEntry;
+    /* nodes replacing a node after a merge with the keys separating them. A
+     * null node means the node was updated in place. */
+    using MergeResult =
+        std::vector<std::pair<K, std::shared_ptr<BaseNodeType>>>;
 
     BaseCOWNode(BaseCOWNode* parent, bptree::PageID pid, bool new_node,
                 KeyComparator kcmp = KeyComparator{}, KeyEq keq = KeyEq{})
         : pid(pid), parent(parent), kcmp(kcmp), keq(keq), size(0),
-          new_node(new_node)
+          new_node(new_node), referenced(true)
     {}
 
     bptree::PageID get_pid() const { return pid; }
@@ -38,6 +68,22 @@ public:
     size_t get_size() const { return size; }
     void set_size(size_t size) { this->size = size; }
 
+    /* reference bit of the node cache */
+    bool is_referenced() const
+    {
+        return referenced.load(std::memory_order_relaxed);
+    }
+    void set_referenced(bool referenced)
+    {
+        this->referenced.store(referenced, std::memory_order_relaxed);
+    }
+
+    /* memory charged to the node cache for the node */
+    virtual size_t get_memory_size() const = 0;
+
+    /* Rebuild the prefix array after the keys are final. */
+    virtual void build_prefixes() = 0;
+
     virtual void serialize(uint8_t* buf, size_t size) const = 0;
     virtual void deserialize(const uint8_t* buf, size_t size) = 0;
 
@@ -53,17 +99,93 @@ public:
     insert_value(typename TreeType::Transaction& txn, const K& key,
                  const V& value, K& split_key, bool update, bool& updated) = 0;
 
+    /* Merge a sorted run of entries into the subtree. */
+    virtual void merge_values(typename TreeType::Transaction& txn,
+                              const MergeEntry* first, const MergeEntry* last,
+                              MergeResult& nodes) = 0;
+
     virtual void
     print(std::ostream& os,
           const std::string& padding = "") = 0; /* for debug purpose */
 
 protected:
+    static const bool HAS_PREFIX = detail::has_key_prefix<K>::value;
+    /* one slot per key padded to a whole number of AVX2 vectors */
+    static const size_t PREFIX_SLOTS = HAS_PREFIX ? (N + 3) & ~3 : 0;
+
+    /* Prefixes are stored with the sign bit flipped so that they can be
+     * compared as signed integers. */
+    static int64_t get_prefix(const K& key)
+    {
+        if constexpr (HAS_PREFIX)
+            return (int64_t)(key.get_prefix() ^ (1ULL << 63));
+        else
+            return 0;
+    }
+
+    void fill_prefixes(const K* keys)
+    {
+        for (size_t i = 0; i < PREFIX_SLOTS; i++) {
+            prefixes[i] = i < size ? get_prefix(keys[i]) : INT64_MAX;
+        }
+    }
+
+    /* Count the prefixes < kp and <= kp without branches. */
+    void count_prefixes(int64_t kp, size_t& lo, size_t& hi) const
+    {
+        lo = hi = 0;
+
+#ifdef _TAGTREE_USE_AVX2_
+        __m256i kv = _mm256_set1_epi64x(kp);
+        for (size_t i = 0; i < size; i += 4) {
+            __m256i pv = _mm256_loadu_si256((const __m256i*)&prefixes[i]);
+            auto lt = _mm256_castsi256_pd(_mm256_cmpgt_epi64(kv, pv));
+            auto gt = _mm256_castsi256_pd(_mm256_cmpgt_epi64(pv, kv));
+
+            lo += __builtin_popcount(_mm256_movemask_pd(lt));
+            hi += 4 - __builtin_popcount(_mm256_movemask_pd(gt));
+        }
+        /* the padding matches a prefix of all ones */
+        hi = std::min(hi, size);
+#else
+        for (size_t i = 0; i < size; i++) {
+            lo += prefixes[i] < kp;
+            hi += prefixes[i] <= kp;
+        }
+#endif
+    }
+
+    /* Index of the first key > key if upper is set or >= key otherwise. The
+     * prefixes of clean nodes narrow the search down to the keys with the
+     * same prefix as key. */
+    size_t search_keys(const K* keys, const K& key, bool upper) const
+    {
+        const K* first = keys;
+        const K* last = keys + size;
+
+        if constexpr (HAS_PREFIX) {
+            if (!new_node) {
+                size_t lo, hi;
+
+                count_prefixes(get_prefix(key), lo, hi);
+                first = keys + lo;
+                last = keys + hi;
+            }
+        }
+
+        auto it = upper ? std::upper_bound(first, last, key, kcmp)
+                        : std::lower_bound(first, last, key, kcmp);
+        return it - keys;
+    }
+
     size_t size;
     BaseCOWNode* parent;
     bptree::PageID pid;
     bool new_node;
     KeyComparator kcmp;
     KeyEq keq;
+    std::atomic<bool> referenced;
+    std::array<int64_t, PREFIX_SLOTS> prefixes;
 };
 
 template <unsigned int N, typename K, typename V, typename KeySerializer,
@@ -99,6 +221,8 @@ public:
         }
     }
 
+    virtual size_t get_memory_size() const { return sizeof(SelfType); }
+
     virtual void serialize(uint8_t* buf, size_t size) const
     {
         /* | size | keys | child_pages | */
@@ -128,31 +252,50 @@ public:
         for (auto&& p : child_cache) {
             p.reset();
         }
+        this->fill_prefixes(keys.begin());
         assert(!this->size ||
                child_pages[this->size] != bptree::Page::INVALID_PAGE_ID);
     }
 
-    BaseNodeType* get_child(int idx)
+    virtual void build_prefixes() { this->fill_prefixes(keys.begin()); }
+
+    /* index of the child that may contain key */
+    size_t find_child(const K& key) const
+    {
+        return this->search_keys(keys.begin(), key, true);
+    }
+
+    /* The child is only kept alive by the node cache of the tree and may be
+     * evicted once the returned pointer is released. */
+    std::shared_ptr<BaseNodeType> get_child(int idx)
     {
+        std::shared_ptr<BaseNodeType> child;
+
         {
             std::shared_lock<std::shared_mutex> guard(child_cache_mutex);
-            if (child_cache[idx]) {
-                /* child in cache */
-                return child_cache[idx].get();
-            }
+            child = child_cache[idx].lock();
         }
 
-        if (child_pages[idx] != bptree::Page::INVALID_PAGE_ID) {
+        if (child) {
+            /* child in cache */
+            child->set_referenced(true);
+            return child;
+        }
+
+        if (child_pages[idx] == bptree::Page::INVALID_PAGE_ID) return nullptr;
+
+        {
             std::unique_lock<std::shared_mutex> guard(child_cache_mutex);
 
-            if (!child_cache[idx]) {
-                child_cache[idx] = tree->read_node(this, child_pages[idx]);
-            }
+            child = child_cache[idx].lock();
+            if (child) return child;
 
-            return child_cache[idx].get();
+            child = tree->read_node(this, child_pages[idx]);
+            child_cache[idx] = child;
         }
 
-        return nullptr;
+        tree->cache_node(child);
+        return child;
     }
 
     virtual void
@@ -163,11 +306,7 @@ public:
                typename BaseNodeType::ValueListIterator& value_last)
     {
         /* direct the search to the child */
-        int child_idx;
-        child_idx = std::distance(keys.begin(),
-                                  std::upper_bound(keys.begin(),
-                                                   keys.begin() + this->size,
-                                                   key, this->kcmp));
+        int child_idx = find_child(key);
 
         if (next_key && child_idx < this->size) {
             *next_key = keys[child_idx];
@@ -191,6 +330,7 @@ public:
         if (!this->is_new_node()) {
             new_node = clone(txn);
             new_node_ptr = new_node.get();
+            txn.retire_page(this->get_pid());
         }
 
         auto it =
@@ -199,7 +339,7 @@ public:
                              key, new_node_ptr->kcmp);
 
         int child_idx = it - new_node_ptr->keys.begin();
-        auto* child = new_node_ptr->get_child(child_idx);
+        auto child = new_node_ptr->get_child(child_idx);
         assert(child);
 
         std::shared_ptr<BaseNodeType> new_child, child_sibling;
@@ -208,7 +348,7 @@ public:
 
         if (new_child) {
             new_node_ptr->child_pages[child_idx] = new_child->get_pid();
-            new_node_ptr->child_cache[child_idx] = std::move(new_child);
+            new_node_ptr->child_cache[child_idx] = new_child;
         }
 
         if (!child_sibling) {
@@ -230,7 +370,7 @@ public:
 
         new_node_ptr->keys[child_idx] = split_key;
         new_node_ptr->child_pages[child_idx + 1] = child_sibling->get_pid();
-        new_node_ptr->child_cache[child_idx + 1] = std::move(child_sibling);
+        new_node_ptr->child_cache[child_idx + 1] = child_sibling;
         new_node_ptr->size++;
 
         assert(new_node_ptr->child_pages[new_node_ptr->size] !=
@@ -252,9 +392,8 @@ public:
                  i++, j++) {
                 right_sibling->child_cache[j] =
                     std::move(new_node_ptr->child_cache[i]);
-                if (right_sibling->child_cache[j]) {
-                    right_sibling->child_cache[j]->set_parent(
-                        right_sibling.get());
+                if (auto child = right_sibling->child_cache[j].lock()) {
+                    child->set_parent(right_sibling.get());
                 }
             }
 
@@ -268,6 +407,111 @@ public:
         return std::make_pair(new_node, right_sibling);
     }
 
+    virtual void merge_values(typename TreeType::Transaction& txn,
+                              const typename BaseNodeType::MergeEntry* first,
+                              const typename BaseNodeType::MergeEntry* last,
+                              typename BaseNodeType::MergeResult& nodes)
+    {
+        std::vector<K> new_keys;
+        std::vector<bptree::PageID> new_pages;
+        std::vector<std::shared_ptr<BaseNodeType>> new_cache;
+        auto child_first = first;
+
+        for (size_t i = 0; i <= this->size; i++) {
+            /* Entries routed to child i. Equal keys can be on both sides of a
+             * separator so updates of the separator key go to both
+             * children. */
+            if (i > 0) {
+                child_first = std::partition_point(
+                    child_first, last, [this, i](const auto& e) {
+                        return this->kcmp(e.key, keys[i - 1]);
+                    });
+            }
+
+            auto child_last = last;
+            if (i < this->size) {
+                child_last = std::partition_point(
+                    child_first, last, [this, i](const auto& e) {
+                        return this->kcmp(e.key, keys[i]) ||
+                               (e.update && this->keq(e.key, keys[i]));
+                    });
+            }
+
+            if (i > 0) new_keys.push_back(keys[i - 1]);
+
+            if (child_first == child_last) {
+                new_pages.push_back(child_pages[i]);
+                new_cache.push_back(child_cache[i].lock());
+                continue;
+            }
+
+            auto child = get_child(i);
+            assert(child);
+
+            typename BaseNodeType::MergeResult child_nodes;
+            child->merge_values(txn, child_first, child_last, child_nodes);
+
+            for (size_t j = 0; j < child_nodes.size(); j++) {
+                auto& node = child_nodes[j].second;
+
+                if (j > 0) new_keys.push_back(child_nodes[j].first);
+
+                if (!node) {
+                    new_pages.push_back(child_pages[i]);
+                    new_cache.push_back(child);
+                } else {
+                    new_pages.push_back(node->get_pid());
+                    new_cache.push_back(std::move(node));
+                }
+            }
+        }
+
+        if (!this->is_new_node()) txn.retire_page(this->get_pid());
+
+        build_nodes(txn, this->parent, this->is_new_node() ? this : nullptr,
+                    new_keys, new_pages, new_cache, nodes);
+    }
+
+    /* Distribute children evenly into as few inner nodes as possible. The
+     * first node is reused if self is given. */
+    static void
+    build_nodes(typename TreeType::Transaction& txn, BaseNodeType* parent,
+                SelfType* self, const std::vector<K>& keys,
+                const std::vector<bptree::PageID>& pages,
+                std::vector<std::shared_ptr<BaseNodeType>>& cache,
+                typename BaseNodeType::MergeResult& nodes)
+    {
+        size_t num_children = pages.size();
+        size_t num_nodes = (num_children + N - 1) / N;
+
+        for (size_t g = 0; g < num_nodes; g++) {
+            size_t start = g * num_children / num_nodes;
+            size_t end = (g + 1) * num_children / num_nodes;
+            std::shared_ptr<SelfType> new_node;
+            SelfType* node = self;
+
+            if (g > 0 || !self) {
+                new_node = txn.template create_node<SelfType>(parent);
+                node = new_node.get();
+            }
+
+            node->size = end - start - 1;
+            for (size_t i = start; i < end; i++) {
+                if (i > start) node->keys[i - start - 1] = keys[i - 1];
+                node->child_pages[i - start] = pages[i];
+                node->child_cache[i - start] = cache[i];
+                if (cache[i]) cache[i]->set_parent(node);
+            }
+            for (size_t i = end - start; i <= N; i++) {
+                node->child_pages[i] = bptree::Page::INVALID_PAGE_ID;
+                node->child_cache[i].reset();
+            }
+
+            nodes.emplace_back(g > 0 ? keys[start - 1] : K{},
+                               std::move(new_node));
+        }
+    }
+
     std::shared_ptr<SelfType> clone(typename TreeType::Transaction& txn)
     {
         auto new_node = txn.template create_node<SelfType>(this->parent);
@@ -294,7 +538,8 @@ private:
     TreeType* tree;
     std::array<K, N> keys;
     std::array<bptree::PageID, N + 1> child_pages;
-    std::array<std::shared_ptr<BaseNodeType>, N + 1> child_cache;
+    /* the node cache of the tree owns the children */
+    std::array<std::weak_ptr<BaseNodeType>, N + 1> child_cache;
     std::shared_mutex child_cache_mutex;
     KeySerializer key_serializer;
 };
@@ -327,6 +572,7 @@ public:
     {}
 
     virtual bool is_leaf() const { return true; }
+    virtual size_t get_memory_size() const { return sizeof(SelfType); }
 
     virtual void serialize(uint8_t* buf, size_t size) const
     {
@@ -352,7 +598,11 @@ public:
         size -= nbytes;
         nbytes = value_serializer.deserialize(values.begin(), values.end(), buf,
                                               size);
+        this->fill_prefixes(keys.begin());
     }
+
+    virtual void build_prefixes() { this->fill_prefixes(keys.begin()); }
+
     virtual void
     get_values(const K& key, bool collect, std::optional<K>* next_key,
                typename BaseNodeType::KeyListIterator* key_first,
@@ -367,8 +617,8 @@ public:
             value_first = values.begin();
             value_last = values.begin() + this->size;
         } else {
-            auto lower = std::lower_bound(
-                keys.begin(), keys.begin() + this->size, key, this->kcmp);
+            auto lower = keys.begin() + this->search_keys(keys.begin(), key,
+                                                          false);
 
             if (lower == keys.begin() + this->size) return;
 
@@ -392,6 +642,7 @@ public:
         if (!this->is_new_node()) {
             new_node = clone(txn);
             new_node_ptr = new_node.get();
+            txn.retire_page(this->get_pid());
         }
 
         if (update) {
@@ -444,6 +695,104 @@ public:
         return std::make_pair(new_node, right_sibling);
     }
 
+    virtual void merge_values(typename TreeType::Transaction& txn,
+                              const typename BaseNodeType::MergeEntry* first,
+                              const typename BaseNodeType::MergeEntry* last,
+                              typename BaseNodeType::MergeResult& nodes)
+    {
+        std::vector<V> old_values(values.begin(), values.begin() + this->size);
+        std::vector<K> new_keys;
+        std::vector<V> new_values;
+        size_t i = 0;
+
+        /* updates replace the value they were computed from */
+        for (auto it = first; it != last; it++) {
+            if (!it->update) continue;
+
+            auto pos = std::lower_bound(
+                keys.begin(), keys.begin() + this->size, it->key, this->kcmp);
+            for (size_t j = pos - keys.begin();
+                 j < this->size && this->keq(it->key, keys[j]); j++) {
+                if (!::memcmp(&values[j], &it->old_value, sizeof(V))) {
+                    old_values[j] = it->value;
+                    break;
+                }
+            }
+        }
+
+        /* inserted values go after the existing values with equal keys */
+        for (auto it = first; it != last; it++) {
+            if (it->update) continue;
+
+            while (i < this->size && !this->kcmp(it->key, keys[i])) {
+                new_keys.push_back(keys[i]);
+                new_values.push_back(old_values[i]);
+                i++;
+            }
+
+            new_keys.push_back(it->key);
+            new_values.push_back(it->value);
+        }
+
+        for (; i < this->size; i++) {
+            new_keys.push_back(keys[i]);
+            new_values.push_back(old_values[i]);
+        }
+
+        size_t num_values = new_keys.size();
+        size_t start = 0;
+
+        if (!this->is_new_node()) txn.retire_page(this->get_pid());
+
+        do {
+            size_t remaining = num_values - start;
+            size_t num_nodes =
+                std::max<size_t>((remaining + N - 2) / (N - 1), 1);
+            size_t end = start + remaining / num_nodes;
+
+            /* keep equal keys in one leaf if possible so that they can be
+             * found by a lookup */
+            if (end < num_values &&
+                this->keq(new_keys[end - 1], new_keys[end])) {
+                size_t b = end;
+
+                while (b > start + 1 && this->keq(new_keys[b - 1], new_keys[b]))
+                    b--;
+
+                if (!this->keq(new_keys[b - 1], new_keys[b])) {
+                    end = b;
+                } else {
+                    b = end;
+                    while (b < num_values && b - start < N - 1 &&
+                           this->keq(new_keys[b - 1], new_keys[b]))
+                        b++;
+
+                    if (b == num_values ||
+                        !this->keq(new_keys[b - 1], new_keys[b]))
+                        end = b;
+                }
+            }
+
+            std::shared_ptr<SelfType> new_node;
+            SelfType* node = this;
+
+            if (start > 0 || !this->is_new_node()) {
+                new_node = txn.template create_node<SelfType>(this->parent);
+                node = new_node.get();
+            }
+
+            node->size = end - start;
+            std::copy(new_keys.begin() + start, new_keys.begin() + end,
+                      node->keys.begin());
+            std::copy(new_values.begin() + start, new_values.begin() + end,
+                      node->values.begin());
+
+            nodes.emplace_back(start > 0 ? new_keys[start] : K{},
+                               std::move(new_node));
+            start = end;
+        } while (start < num_values);
+    }
+
     std::shared_ptr<SelfType> clone(typename TreeType::Transaction& txn)
     {
         auto new_node = txn.template create_node<SelfType>(this->parent);
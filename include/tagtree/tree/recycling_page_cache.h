@@ -0,0 +1,62 @@
+#ifndef _TAGTREE_RECYCLING_PAGE_CACHE_H_
+#define _TAGTREE_RECYCLING_PAGE_CACHE_H_
+
+#include "bptree/page_cache.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace tagtree {
+
+/* Page cache that reuses the pages freed by the tree before allocating new
+ * ones. Pages retired by a commit are only freed after all versions that
+ * can reach them are gone. The free list is persisted in a side file:
+ *
+ * | magic | (version, page id) ... |
+ *
+ * where version is 0 for pages that are free and the version of the
+ * retiring commit otherwise. */
+class RecyclingPageCache : public bptree::AbstractPageCache {
+public:
+    RecyclingPageCache(std::unique_ptr<bptree::AbstractPageCache> cache,
+                       std::string_view filename);
+
+    virtual bptree::Page* new_page(boost::upgrade_lock<bptree::Page>& lock);
+    virtual bptree::Page* fetch_page(bptree::PageID id,
+                                     boost::upgrade_lock<bptree::Page>& lock);
+    virtual void unpin_page(bptree::Page* page, bool dirty,
+                            boost::upgrade_lock<bptree::Page>& lock);
+    virtual void flush_all_pages();
+    virtual size_t get_page_size() const;
+
+    /* Record the pages that are no longer reachable from version. */
+    void retire_pages(uint32_t version,
+                      const std::vector<bptree::PageID>& pages);
+    /* Free the pages retired by the versions up to version. */
+    void reclaim_pages(uint32_t version);
+
+    /* Write the free list to the side file. */
+    void save();
+
+    size_t get_num_free_pages();
+
+private:
+    static const uint32_t MAGIC = 0x46524545;
+
+    std::unique_ptr<bptree::AbstractPageCache> cache;
+    std::string filename;
+
+    std::vector<bptree::PageID> free_pages;
+    std::map<uint32_t, std::vector<bptree::PageID>> retired_pages;
+    std::mutex mutex;
+
+    void load();
+};
+
+} // namespace tagtree
+
+#endif
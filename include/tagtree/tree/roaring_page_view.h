@@ -0,0 +1,44 @@
+#ifndef _TAGTREE_ROARING_PAGE_VIEW_H_
+#define _TAGTREE_ROARING_PAGE_VIEW_H_
+
+#include "tagtree/series/symbol_table.h"
+#include "tagtree/tree/item_page_view.h"
+#include "tagtree/tsid.h"
+
+#include "roaring.hh"
+
+#include <iostream>
+
+namespace tagtree {
+
+/* Posting page that packs serialized Roaring bitmaps of several label values
+ * of the same label name. Each item is | value ref | segsel | roaring |. */
+class RoaringPageView : public ItemPageView {
+public:
+    RoaringPageView(uint8_t* buf, size_t size) : ItemPageView(buf, size) {}
+
+    bool get_postings(SymbolTable::Ref value_ref, unsigned int segsel,
+                      Roaring& bitmap) const;
+    bool insert(SymbolTable::Ref value_ref, unsigned int segsel,
+                const Roaring& bitmap);
+
+    static size_t get_item_size(const Roaring& bitmap)
+    {
+        return ITEM_HEADER_SIZE + bitmap.getSizeInBytes(true);
+    }
+
+    friend std::ostream& operator<<(std::ostream& os,
+                                    const RoaringPageView& self);
+
+private:
+    static const size_t ITEM_HEADER_SIZE =
+        sizeof(SymbolTable::Ref) + sizeof(uint32_t);
+
+    /* Return the offset of the item or NO_TARGET if there is none. */
+    unsigned int find_item(SymbolTable::Ref value_ref,
+                           unsigned int segsel) const;
+};
+
+} // namespace tagtree
+
+#endif
@@ -2,34 +2,149 @@
 #define _TAGTREE_SORTED_LIST_PAGE_VIEW_H_
 
 #include "tagtree/series/symbol_table.h"
-#include "tagtree/tree/item_page_view.h"
 #include "tagtree/tsid.h"
 
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <iostream>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace tagtree {
 
-class SortedListPageView : public ItemPageView {
+/* Posting page of (value ref, TSID) pairs. The TSIDs of a value are stored
+ * in one block as varint-encoded deltas. Block headers are sorted by value
+ * ref at the beginning of the page and the block data grows downward from
+ * the end of the page in the same order:
+ *
+ * | num blocks | num postings | headers ... | free | ... data of blocks |
+ */
+class SortedListPageView {
 public:
-    SortedListPageView(uint8_t* buf, size_t size) : ItemPageView(buf, size) {}
+    SortedListPageView(uint8_t* buf, size_t size) : buf(buf), size(size) {}
+
+    void init_page();
+
+    /* number of postings in the page */
+    inline size_t get_item_count() const { return get_num_postings(); }
 
     void get_values(SymbolTable::Ref key, std::vector<TSID>& values);
     void scan_values(std::function<bool(SymbolTable::Ref)> pred,
                      std::vector<TSID>& values);
+    /* Get all postings in the page sorted by value ref and TSID. */
+    void
+    get_postings(std::vector<std::pair<SymbolTable::Ref, TSID>>& postings);
     bool insert(SymbolTable::Ref key, TSID value);
 
+    /* Estimated space taken by count TSIDs of a value between first and
+     * last. */
+    static size_t estimate_block_size(size_t count, TSID first, TSID last);
+
     friend std::ostream& operator<<(std::ostream& os,
                                     const SortedListPageView& self);
 
 private:
-    static const int FIRST_KEY_OFFSET = 1;
+    friend class SortedListPageBuilder;
+
+    struct BlockHeader {
+        SymbolTable::Ref key;
+        uint16_t offset;
+        uint16_t length;
+        TSID first;
+        TSID last;
+    };
+    static_assert(sizeof(BlockHeader) == 24, "BlockHeader has wrong size");
+
+    static const int P_NUM_BLOCKS = 0;
+    static const int P_NUM_POSTINGS = P_NUM_BLOCKS + sizeof(uint32_t);
+    static const int P_BLOCKS = P_NUM_POSTINGS + sizeof(uint32_t);
+
+    uint8_t* buf;
+    size_t size;
+
+    inline uint32_t get_num_blocks() const
+    {
+        return *(uint32_t*)&buf[P_NUM_BLOCKS];
+    }
+    inline void set_num_blocks(uint32_t n)
+    {
+        *(uint32_t*)&buf[P_NUM_BLOCKS] = n;
+    }
+    inline uint32_t get_num_postings() const
+    {
+        return *(uint32_t*)&buf[P_NUM_POSTINGS];
+    }
+    inline void set_num_postings(uint32_t n)
+    {
+        *(uint32_t*)&buf[P_NUM_POSTINGS] = n;
+    }
+
+    inline BlockHeader* get_block(unsigned int idx) const
+    {
+        return (BlockHeader*)&buf[P_BLOCKS + idx * sizeof(BlockHeader)];
+    }
+
+    inline size_t get_data_start() const
+    {
+        return get_num_blocks() ? get_block(0)->offset : size;
+    }
+    inline size_t get_free_space() const
+    {
+        return get_data_start() - P_BLOCKS -
+               get_num_blocks() * sizeof(BlockHeader);
+    }
+
+    /* index of the first block with a key >= key */
+    unsigned int find_block(SymbolTable::Ref key) const;
 
-    std::tuple<SymbolTable::Ref, TSID> extract_item(unsigned int offset) const;
-    static void serialize_item(SymbolTable::Ref key, TSID value,
-                               std::vector<uint8_t>& out);
+    void decode_block(const BlockHeader* block,
+                      std::vector<TSID>& values) const;
+    static void encode_block(const std::vector<TSID>& values,
+                             std::vector<uint8_t>& out);
+
+    /* Grow a block by moving the data of the block and the blocks before it
+     * toward the beginning of the page. The old data is kept at the start of
+     * the block. */
+    void grow_block(unsigned int idx, size_t length);
+};
+
+/* Build sorted list pages in one pass from postings sorted by value ref and
+ * TSID. */
+class SortedListPageBuilder {
+public:
+    explicit SortedListPageBuilder(size_t size);
+
+    /* Add a posting to the page. Return false if the page is full. */
+    bool add(SymbolTable::Ref key, TSID value);
+
+    bool empty() const { return num_postings == 0; }
+    size_t get_item_count() const { return num_postings; }
+
+    /* Get the value refs in the page in ascending order. */
+    void get_keys(std::vector<SymbolTable::Ref>& keys) const
+    {
+        for (auto&& block : blocks) {
+            keys.push_back(block.key);
+        }
+    }
+
+    /* Write the page to buf and reset the builder. */
+    void finish(uint8_t* buf);
+
+private:
+    size_t size;
+    size_t num_postings;
+    std::vector<SortedListPageView::BlockHeader> blocks;
+    std::vector<uint8_t> data;
 
-    size_t binary_search_page(SymbolTable::Ref key, TSID value, bool next_key);
+    inline size_t get_free_space() const
+    {
+        return size - SortedListPageView::P_BLOCKS -
+               blocks.size() * sizeof(SortedListPageView::BlockHeader) -
+               data.size();
+    }
 };
 
 } // namespace tagtree
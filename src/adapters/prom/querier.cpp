@@ -13,10 +13,9 @@ PromQuerier::PromQuerier(IndexedStorage* parent, uint64_t mint, uint64_t maxt)
 std::shared_ptr<promql::SeriesSet>
 PromQuerier::select(const std::vector<promql::LabelMatcher>& matchers)
 {
-    MemPostingList tsids;
-    parent->get_index()->resolve_label_matchers(matchers, min_t, max_t, tsids);
+    auto postings = parent->get_index()->get_postings(matchers, min_t, max_t);
 
-    auto ss = querier->select(tsids);
+    auto ss = querier->select(std::move(postings));
     return std::make_shared<PromSeriesSet>(parent, ss);
 }
 
@@ -9,6 +9,82 @@
 
 namespace tagtree {
 
+static const size_t VALUE_BATCH_SIZE = 256;
+
+/* buffer the extracted values so that they are added to the roaring bitmap in
+ * batches instead of one by one */
+struct RoaringBatchAdder {
+    Roaring& roaring;
+    uint32_t values[VALUE_BATCH_SIZE];
+    size_t count;
+
+    RoaringBatchAdder(Roaring& roaring) : roaring(roaring), count(0) {}
+    ~RoaringBatchAdder() { flush(); }
+
+    inline void add_word(uint64_t word, uint32_t base)
+    {
+        if (word == UINT64_MAX) {
+            roaring.addRange(base, (uint64_t)base + 64);
+            return;
+        }
+
+        if (count > VALUE_BATCH_SIZE - 64) flush();
+
+        while (word) {
+#ifdef _TAGTREE_USE_AVX2_
+            values[count++] = base + _tzcnt_u64(word);
+#else
+            values[count++] = base + __builtin_ctzll(word);
+#endif
+            word &= word - 1;
+        }
+    }
+
+    inline void flush()
+    {
+        if (count) roaring.addMany(count, values);
+        count = 0;
+    }
+};
+
+void roaring_to_bitmap(const Roaring& roaring, uint32_t base, void* bitmap,
+                       size_t size)
+{
+    uint64_t* pbm = (uint64_t*)bitmap;
+    uint64_t limit = (uint64_t)base + (size << 3);
+    uint32_t values[VALUE_BATCH_SIZE];
+    roaring_uint32_iterator_t it;
+
+    roaring_init_iterator(&roaring.roaring, &it);
+    if (!roaring_move_uint32_iterator_equalorlarger(&it, base)) return;
+
+    while (true) {
+        uint32_t n =
+            roaring_read_uint32_iterator(&it, values, VALUE_BATCH_SIZE);
+
+        for (uint32_t i = 0; i < n; i++) {
+            if (values[i] >= limit) return;
+
+            uint32_t bitnum = values[i] - base;
+            pbm[bitnum >> 6] |= 1ULL << (bitnum & 0x3f);
+        }
+
+        if (n < VALUE_BATCH_SIZE) return;
+    }
+}
+
+size_t bitmap_popcount(const void* bitmap, size_t size)
+{
+    const uint64_t* pw = (const uint64_t*)bitmap;
+    const uint64_t* lim = (const uint64_t*)((const uint8_t*)bitmap + size);
+    size_t count = 0;
+
+    while (pw < lim)
+        count += __builtin_popcountll(*pw++);
+
+    return count;
+}
+
 #ifdef _TAGTREE_USE_AVX2_
 
 void bitmap_and(const void* a, const void* b, void* c, size_t size)
@@ -49,6 +125,60 @@ void bitmap_or(const void* a, const void* b, void* c, size_t size)
     }
 }
 
+void bitmap_andnot(const void* a, const void* b, void* c, size_t size)
+{
+    const uint8_t* pa = (const uint8_t*)a;
+    const uint8_t* pb = (const uint8_t*)b;
+    uint8_t* pc = (uint8_t*)c;
+    const size_t block_width = 32;
+
+    while (pa < ((uint8_t*)a + size)) {
+        __m256i ma = _mm256_loadu_si256((const __m256i*)pa);
+        __m256i mb = _mm256_loadu_si256((const __m256i*)pb);
+        __m256i mc = _mm256_andnot_si256(mb, ma);
+        _mm256_storeu_si256((__m256i*)pc, mc);
+
+        pa += block_width;
+        pb += block_width;
+        pc += block_width;
+    }
+}
+
+void bitmap_to_roaring(const void* bitmap, size_t size, uint32_t base,
+                       Roaring& roaring)
+{
+    const uint8_t* p = (const uint8_t*)bitmap;
+    const uint8_t* lim = p + size;
+    const size_t block_width = 32;
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    RoaringBatchAdder adder(roaring);
+
+    while (p + block_width <= lim) {
+        __m256i m = _mm256_loadu_si256((const __m256i*)p);
+
+        if (_mm256_testc_si256(m, ones)) {
+            roaring.addRange(base, (uint64_t)base + (block_width << 3));
+        } else if (!_mm256_testz_si256(m, m)) {
+            const uint64_t* pw = (const uint64_t*)p;
+
+            for (int i = 0; i < 4; i++) {
+                if (pw[i]) adder.add_word(pw[i], base + (i << 6));
+            }
+        }
+
+        p += block_width;
+        base += block_width << 3;
+    }
+
+    while (p < lim) {
+        uint64_t word = *(const uint64_t*)p;
+        if (word) adder.add_word(word, base);
+
+        p += sizeof(uint64_t);
+        base += 64;
+    }
+}
+
 #else
 void bitmap_and(const void* a, const void* b, void* c, size_t size)
 {
@@ -80,6 +210,36 @@ void bitmap_or(const void* a, const void* b, void* c, size_t size)
     }
 }
 
+void bitmap_andnot(const void* a, const void* b, void* c, size_t size)
+{
+    const uint64_t* pa = (const uint64_t*)a;
+    const uint64_t* pb = (const uint64_t*)b;
+    uint64_t* pc = (uint64_t*)c;
+
+    while (pa < (uint64_t*)((uint8_t*)a + size)) {
+        *pc = *pa & ~*pb;
+
+        pa++;
+        pb++;
+        pc++;
+    }
+}
+
+void bitmap_to_roaring(const void* bitmap, size_t size, uint32_t base,
+                       Roaring& roaring)
+{
+    const uint64_t* pw = (const uint64_t*)bitmap;
+    const uint64_t* lim = (const uint64_t*)((const uint8_t*)bitmap + size);
+    RoaringBatchAdder adder(roaring);
+
+    while (pw < lim) {
+        if (*pw) adder.add_word(*pw, base);
+
+        pw++;
+        base += 64;
+    }
+}
+
 #endif
 
 } // namespace tagtree
@@ -0,0 +1,58 @@
+#include "tagtree/index/fetch_worker_pool.h"
+
+namespace tagtree {
+
+FetchWorkerPool::FetchWorkerPool(unsigned int num_workers) : stopping(false)
+{
+    for (unsigned int i = 0; i < num_workers; i++) {
+        workers.emplace_back(&FetchWorkerPool::worker, this);
+    }
+}
+
+FetchWorkerPool::~FetchWorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+
+    for (auto&& t : workers) {
+        t.join();
+    }
+}
+
+void FetchWorkerPool::submit(std::vector<Task>& tasks)
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        for (auto&& task : tasks) {
+            queue.push_back(std::move(task));
+        }
+    }
+
+    cv.notify_all();
+}
+
+void FetchWorkerPool::worker()
+{
+    while (true) {
+        Task task;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return stopping || !queue.empty(); });
+
+            /* queued tasks are finished before stopping */
+            if (queue.empty()) return;
+
+            task = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        task();
+    }
+}
+
+} // namespace tagtree
@@ -2,9 +2,11 @@
 #include "tagtree/series/series_manager.h"
 #include "tagtree/wal/record_serializer.h"
 
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <thread>
+#include <tuple>
 #include <unordered_set>
 
 using promql::MatchOp;
@@ -13,9 +15,9 @@ namespace tagtree {
 
 IndexServer::IndexServer(std::string_view index_dir, size_t cache_size,
                          AbstractSeriesManager* sm, bool bitmap_only,
-                         bool full_cache, CheckpointPolicy checkpoint_policy)
-    : index_tree(this, std::string(index_dir) + "/index.db", cache_size,
-                 bitmap_only),
+                         bool full_cache, CheckpointPolicy checkpoint_policy,
+                         uint64_t partition_duration)
+    : index_tree(this, index_dir, cache_size, bitmap_only, partition_duration),
       wal(std::string(index_dir) + "/wal"), full_cache(full_cache),
       last_compaction_timestamp(0), checkpoint_policy(checkpoint_policy)
 {
@@ -82,7 +84,10 @@ void IndexServer::exists(const std::vector<promql::Label>& labels,
         return;
     }
 
-    index_tree.resolve_label_matchers(matchers, 0, UINT64_MAX, tsids);
+    std::vector<promql::LabelMatcher> plan;
+    plan_matchers(matchers, plan);
+
+    index_tree.resolve_label_matchers(plan, 0, UINT64_MAX, tsids);
 
     if (tsids.cardinality() == 1) {
         /* if found also add it to the cache to speed up the next lookup */
@@ -90,42 +95,177 @@ void IndexServer::exists(const std::vector<promql::Label>& labels,
     }
 }
 
+class IndexServer::QueryCachePostingsIterator : public PostingsIterator {
+public:
+    QueryCachePostingsIterator(IndexServer* server, std::string key,
+                               std::unique_ptr<PostingsIterator> postings,
+                               unsigned int tree_version,
+                               uint64_t compaction_timestamp, TSID watermark)
+        : server(server), key(std::move(key)), postings(std::move(postings)),
+          tree_version(tree_version),
+          compaction_timestamp(compaction_timestamp), watermark(watermark),
+          next_tsid(0), complete(true)
+    {}
+
+    virtual bool next()
+    {
+        if (!postings->next()) {
+            finish();
+            return false;
+        }
+
+        add(postings->at());
+        return true;
+    }
+
+    virtual bool seek(TSID tsid)
+    {
+        /* the postings skipped by the seek are never seen */
+        if (tsid > next_tsid) complete = false;
+
+        if (!postings->seek(tsid)) {
+            finish();
+            return false;
+        }
+
+        add(postings->at());
+        return true;
+    }
+
+    virtual TSID at() const { return postings->at(); }
+
+private:
+    IndexServer* server;
+    std::string key;
+    std::unique_ptr<PostingsIterator> postings;
+    unsigned int tree_version;
+    uint64_t compaction_timestamp;
+    TSID watermark;
+
+    MemPostingList tsids;
+    TSID next_tsid;
+    bool complete;
+
+    void add(TSID tsid)
+    {
+        if (!complete || tsid < next_tsid) return;
+
+        tsids.add(tsid);
+        next_tsid = tsid + 1;
+    }
+
+    void finish()
+    {
+        if (!complete) return;
+
+        server->insert_query_cache(key, tsids, tree_version,
+                                   compaction_timestamp, watermark);
+        complete = false;
+    }
+};
+
+std::unique_ptr<PostingsIterator>
+IndexServer::get_postings(const std::vector<promql::LabelMatcher>& matchers,
+                          uint64_t start, uint64_t end)
+{
+    MemPostingList tsids;
+
+    auto tsid = get_tsid_by_matchers(matchers);
+    if (tsid) {
+        tsids.add(tsid.value());
+        return std::make_unique<RoaringPostingsIterator>(std::move(tsids));
+    }
+
+    auto cache_key = get_query_cache_key(matchers, start, end);
+    if (lookup_query_cache(cache_key, matchers, tsids)) {
+        return std::make_unique<RoaringPostingsIterator>(std::move(tsids));
+    }
+
+    /* read the tags before resolving, see resolve_label_matchers() */
+    TSID watermark = id_counter.load();
+    auto tree_version = index_tree.get_version();
+    auto compaction_timestamp = last_compaction_timestamp;
+
+    std::vector<promql::LabelMatcher> plan;
+    plan_matchers(matchers, plan);
+
+    mem_index.resolve_label_matchers(plan, tsids);
+    std::unique_ptr<PostingsIterator> postings =
+        std::make_unique<RoaringPostingsIterator>(std::move(tsids));
+
+    if (compaction_timestamp >= start) {
+        postings = std::make_unique<MergedPostingsIterator>(
+            index_tree.get_postings(plan, start, end), std::move(postings));
+    }
+
+    return std::make_unique<QueryCachePostingsIterator>(
+        this, std::move(cache_key), std::move(postings), tree_version,
+        compaction_timestamp, watermark);
+}
+
+size_t IndexServer::estimate_cardinality(
+    const std::vector<promql::LabelMatcher>& matchers, uint64_t start,
+    uint64_t end)
+{
+    MemPostingList tsids;
+
+    auto cache_key = get_query_cache_key(matchers, start, end);
+    if (lookup_query_cache(cache_key, matchers, tsids)) {
+        return tsids.cardinality();
+    }
+
+    std::vector<promql::LabelMatcher> plan;
+    plan_matchers(matchers, plan);
+
+    mem_index.resolve_label_matchers(plan, tsids);
+    size_t count = tsids.cardinality();
+
+    if (last_compaction_timestamp >= start) {
+        count += index_tree.estimate_cardinality(plan, start, end);
+    }
+
+    return count;
+}
+
 void IndexServer::resolve_label_matchers(
     const std::vector<promql::LabelMatcher>& matchers, uint64_t start,
     uint64_t end, MemPostingList& tsids)
 {
-    std::vector<promql::Label> labels;
     MemPostingList tree_postings, mem_postings;
 
-    bool equal_pred = true;
-    for (auto&& matcher : matchers) {
-        if (matcher.op != promql::MatchOp::EQL) {
-            equal_pred = false;
-            break;
-        }
+    auto tsid = get_tsid_by_matchers(matchers);
+    if (tsid) {
+        tsids = MemPostingList();
+        tsids.add(tsid.value());
+        return;
+    }
 
-        labels.push_back({matcher.name, matcher.value});
+    auto cache_key = get_query_cache_key(matchers, start, end);
+    if (lookup_query_cache(cache_key, matchers, tsids)) {
+        return;
     }
 
-    if (equal_pred) {
-        auto tsid = series_manager->get_tsid_by_label_set(labels);
+    /* read the tags before resolving so that the changes made in between
+     * invalidate the entry or are checked on the next hit */
+    TSID watermark = id_counter.load();
+    auto tree_version = index_tree.get_version();
+    auto compaction_timestamp = last_compaction_timestamp;
 
-        if (tsid) {
-            tsids = MemPostingList();
-            tsids.add(tsid.value());
-            return;
-        }
-    }
+    std::vector<promql::LabelMatcher> plan;
+    plan_matchers(matchers, plan);
 
-    mem_index.resolve_label_matchers(matchers, mem_postings);
+    mem_index.resolve_label_matchers(plan, mem_postings);
 
-    if (last_compaction_timestamp >= start) {
-        index_tree.resolve_label_matchers(matchers, start, end, tree_postings);
+    if (compaction_timestamp >= start) {
+        index_tree.resolve_label_matchers(plan, start, end, tree_postings);
         tsids = tree_postings | mem_postings;
     } else {
         tsids = mem_postings;
     }
 
+    insert_query_cache(cache_key, tsids, tree_version, compaction_timestamp,
+                       watermark);
+
     if (tsids.cardinality() == 1) {
         // touch the series entry to load it into cache
         auto entry = series_manager->get(*tsids.begin());
@@ -135,6 +275,188 @@ void IndexServer::resolve_label_matchers(
     }
 }
 
+std::optional<TSID> IndexServer::get_tsid_by_matchers(
+    const std::vector<promql::LabelMatcher>& matchers)
+{
+    std::vector<promql::Label> labels;
+
+    for (auto&& matcher : matchers) {
+        if (matcher.op != promql::MatchOp::EQL) return std::nullopt;
+
+        labels.push_back({matcher.name, matcher.value});
+    }
+
+    return series_manager->get_tsid_by_label_set(labels);
+}
+
+void IndexServer::plan_matchers(
+    const std::vector<promql::LabelMatcher>& matchers,
+    std::vector<promql::LabelMatcher>& plan)
+{
+    std::vector<std::pair<size_t, size_t>> costs;
+
+    for (size_t i = 0; i < matchers.size(); i++) {
+        auto& matcher = matchers[i];
+        size_t cost = SIZE_MAX;
+
+        if (!is_negative_matcher(matcher)) {
+            cost = mem_index.estimate_postings(matcher) +
+                   index_tree.estimate_postings(matcher);
+        }
+
+        costs.emplace_back(cost, i);
+    }
+
+    std::stable_sort(costs.begin(), costs.end(),
+                     [](const auto& lhs, const auto& rhs) {
+                         return lhs.first < rhs.first;
+                     });
+
+    plan.clear();
+    plan.reserve(matchers.size());
+    for (auto&& p : costs) {
+        plan.push_back(matchers[p.second]);
+    }
+}
+
+static bool match_series_labels(
+    const std::vector<promql::LabelMatcher>& matchers,
+    const std::vector<promql::Label>& labels)
+{
+    /* same semantics as MemIndex::resolve_label_matchers() */
+    bool has_positive = std::any_of(
+        matchers.begin(), matchers.end(),
+        [](const promql::LabelMatcher& m) { return !is_negative_matcher(m); });
+
+    for (auto&& matcher : matchers) {
+        auto it = std::find_if(labels.begin(), labels.end(),
+                               [&matcher](const promql::Label& l) {
+                                   return l.name == matcher.name;
+                               });
+
+        if (it == labels.end()) {
+            /* negative matchers only exclude series with the label */
+            if (!is_negative_matcher(matcher) || !has_positive) return false;
+            continue;
+        }
+
+        if (!matcher.match_value(it->value)) return false;
+    }
+
+    return true;
+}
+
+std::string IndexServer::get_query_cache_key(
+    const std::vector<promql::LabelMatcher>& matchers, uint64_t start,
+    uint64_t end)
+{
+    std::vector<const promql::LabelMatcher*> sorted;
+    std::ostringstream oss;
+
+    for (auto&& p : matchers) {
+        sorted.push_back(&p);
+    }
+
+    std::sort(sorted.begin(), sorted.end(),
+              [](const promql::LabelMatcher* lhs,
+                 const promql::LabelMatcher* rhs) {
+                  return std::tie(lhs->name, lhs->op, lhs->value) <
+                         std::tie(rhs->name, rhs->op, rhs->value);
+              });
+
+    for (auto* p : sorted) {
+        oss << p->name << '\0' << (int)p->op << '\0' << p->value << '\0';
+    }
+    oss << start << ',' << end;
+
+    return oss.str();
+}
+
+bool IndexServer::lookup_query_cache(
+    const std::string& key, const std::vector<promql::LabelMatcher>& matchers,
+    MemPostingList& tsids)
+{
+    CachedPostings entry;
+    TSID current_id = id_counter.load();
+
+    {
+        std::lock_guard<std::mutex> lock(query_cache_mutex);
+
+        auto it = query_cache_map.find(key);
+        if (it == query_cache_map.end()) return false;
+
+        auto& cached = it->second->second;
+
+        if (cached.tree_version != index_tree.get_version() ||
+            cached.compaction_timestamp != last_compaction_timestamp ||
+            current_id - cached.watermark > QUERY_CACHE_MAX_DELTA) {
+            query_cache_list.erase(it->second);
+            query_cache_map.erase(it);
+            return false;
+        }
+
+        query_cache_list.splice(query_cache_list.begin(), query_cache_list,
+                                it->second);
+        entry = cached;
+    }
+
+    /* check the series added since the entry is updated without holding the
+     * lock as the series may have to be read from disk */
+    TSID old_watermark = entry.watermark;
+    std::vector<promql::Label> labels;
+    for (TSID tsid = entry.watermark; tsid < current_id; tsid++) {
+        /* stop at series that are still being added */
+        if (!get_labels(tsid, labels)) break;
+
+        if (match_series_labels(matchers, labels)) entry.tsids.add(tsid);
+        entry.watermark = tsid + 1;
+    }
+
+    tsids = entry.tsids;
+
+    if (entry.watermark != old_watermark) {
+        std::lock_guard<std::mutex> lock(query_cache_mutex);
+
+        /* keep the entry if it is replaced or advanced in the meantime */
+        auto it = query_cache_map.find(key);
+        if (it != query_cache_map.end()) {
+            auto& cached = it->second->second;
+
+            if (cached.tree_version == entry.tree_version &&
+                cached.compaction_timestamp == entry.compaction_timestamp &&
+                cached.watermark < entry.watermark)
+                cached = std::move(entry);
+        }
+    }
+
+    return true;
+}
+
+void IndexServer::insert_query_cache(const std::string& key,
+                                     const MemPostingList& tsids,
+                                     unsigned int tree_version,
+                                     uint64_t compaction_timestamp,
+                                     TSID watermark)
+{
+    std::lock_guard<std::mutex> lock(query_cache_mutex);
+
+    auto it = query_cache_map.find(key);
+    if (it != query_cache_map.end()) {
+        query_cache_list.erase(it->second);
+        query_cache_map.erase(it);
+    }
+
+    query_cache_list.emplace_front(
+        key,
+        CachedPostings{tsids, tree_version, compaction_timestamp, watermark});
+    query_cache_map.emplace(key, query_cache_list.begin());
+
+    if (query_cache_list.size() > QUERY_CACHE_SIZE) {
+        query_cache_map.erase(query_cache_list.back().first);
+        query_cache_list.pop_back();
+    }
+}
+
 bool IndexServer::get_labels(TSID tsid, std::vector<promql::Label>& labels)
 {
     // return series_manager->get_label_set(tsid, labels);
@@ -149,12 +471,22 @@ bool IndexServer::get_labels(TSID tsid, std::vector<promql::Label>& labels)
 }
 
 void IndexServer::label_values(const std::string& label_name,
-                               std::unordered_set<std::string>& values)
+                               std::unordered_set<std::string>& values,
+                               uint64_t start, uint64_t end)
 {
     values.clear();
 
-    mem_index.label_values(label_name, values);
-    index_tree.label_values(label_name, values);
+    mem_index.label_values(label_name, start, end, values);
+    index_tree.label_values(label_name, start, end, values);
+}
+
+void IndexServer::label_names(std::unordered_set<std::string>& names,
+                              uint64_t start, uint64_t end)
+{
+    names.clear();
+
+    mem_index.label_names(start, end, names);
+    index_tree.label_names(start, end, names);
 }
 
 void IndexServer::commit(const std::vector<SeriesRef>& series)
@@ -196,6 +528,11 @@ bool IndexServer::try_compact(bool force, bool detach)
 
 void IndexServer::manual_compact() { try_compact(true, false); }
 
+size_t IndexServer::drop_expired(uint64_t retention_timestamp)
+{
+    return index_tree.drop_partitions(retention_timestamp);
+}
+
 bool IndexServer::compactable(TSID current_id)
 {
     return (checkpoint_policy != CheckpointPolicy::DISABLED) &&
@@ -6,9 +6,14 @@
 #include "tagtree/index/bitmap.h"
 #include "tagtree/index/index_server.h"
 #include "tagtree/series/series_manager.h"
+#include "tagtree/tree/roaring_page_view.h"
 #include "tagtree/tree/sorted_list_page_view.h"
 
+#include "xxhash.h"
+
+#include <algorithm>
 #include <cassert>
+#include <iterator>
 #include <iostream>
 
 using promql::MatchOp;
@@ -17,44 +22,27 @@ namespace tagtree {
 
 std::ostream& operator<<(std::ostream& out, const TreeValue& val)
 {
-    out << '(' << val.value_ref << ", " << val.page_id << ')';
+    out << '(' << val.name_ref << ", " << val.value_ref << ", " << val.page_id
+        << ", " << val.page_type << ", " << val.num_postings << ", "
+        << val.end_timestamp << ')';
     return out;
 }
 
-static void incr_buf(uint8_t* buf, size_t len)
-{
-    int i = len - 1;
-    uint32_t carry = 1;
-
-    while (carry && i >= 0) {
-        uint32_t s = (uint32_t)buf[i] + carry;
-        buf[i] = s & 0xff;
-        carry = (s >> 8) & 0xff;
-        i--;
-    }
-}
-
 void IndexTree::copy_to_bitmaps(
     const Roaring& bitmap,
     std::map<unsigned int, std::unique_ptr<uint8_t[]>>& bitmaps,
     const std::set<unsigned int>& seg_mask)
 {
-    unsigned int skip = -1;
-    unsigned int cur_seg = -1;
-    uint8_t* page_buf = nullptr;
+    auto it = bitmap.begin();
 
-    for (auto it = bitmap.begin(); it != bitmap.end(); it++) {
+    while (it != bitmap.end()) {
         auto seg = tsid_segsel(*it);
+        uint64_t next_seg_start = (uint64_t)(seg + 1) * postings_per_page;
 
-        if (seg == skip) continue;
-
-        if (cur_seg != seg) {
-            if (!seg_mask.empty() && seg_mask.find(seg) == seg_mask.end()) {
-                skip = seg;
-                continue;
-            }
-
+        if (seg_mask.empty() || seg_mask.find(seg) != seg_mask.end()) {
+            uint8_t* page_buf;
             auto bmit = bitmaps.find(seg);
+
             if (bmit == bitmaps.end()) {
                 auto bmbuf =
                     std::make_unique<uint8_t[]>(page_cache->get_page_size());
@@ -64,91 +52,285 @@ void IndexTree::copy_to_bitmaps(
             } else {
                 page_buf = bmit->second.get();
             }
-        }
 
-        {
-            uint64_t* bm =
-                reinterpret_cast<uint64_t*>(page_buf + BITMAP_PAGE_OFFSET);
-            size_t bitnum = *it % postings_per_page;
-            bm[bitnum >> 6] |= 1ULL << (bitnum & 0x3f);
+            roaring_to_bitmap(bitmap, seg * postings_per_page,
+                              page_buf + BITMAP_PAGE_OFFSET,
+                              page_cache->get_page_size() - BITMAP_PAGE_OFFSET);
         }
 
-        cur_seg = seg;
+        if (next_seg_start > UINT32_MAX) break;
+        it.equalorlarger(next_seg_start);
     }
 }
 
 IndexTree::IndexTree(IndexServer* server, std::string_view filename,
-                     size_t cache_size, bool bitmap_only)
-    : server(server), page_cache(std::make_unique<bptree::HeapPageCache>(
-                          filename, true, cache_size)),
-      cow_tree(page_cache.get()), bitmap_only(bitmap_only)
+                     size_t cache_size, bool bitmap_only,
+                     std::shared_ptr<FetchWorkerPool> fetch_pool)
+    : server(server),
+      page_cache(std::make_unique<RecyclingPageCache>(
+          std::make_unique<bptree::HeapPageCache>(filename, true, cache_size),
+          std::string(filename) + ".free")),
+      cow_tree(page_cache.get(), cache_size * page_cache->get_page_size(),
+               FORMAT_VERSION),
+      catalog(std::string(filename) + ".catalog"), bitmap_only(bitmap_only),
+      fetch_pool(std::move(fetch_pool))
 {
+    /* the fanout of the tree is computed for PAGE_SIZE */
+    assert(page_cache->get_page_size() >= PAGE_SIZE);
+
     postings_per_page = (page_cache->get_page_size() - BITMAP_PAGE_OFFSET) << 3;
+    /* inline postings are 16-bit offsets into their segment */
+    max_inline_postings = postings_per_page <= ((size_t)UINT16_MAX + 1)
+                              ? TreeValue::MAX_INLINE_POSTINGS
+                              : 0;
 }
 
-IndexTree::~IndexTree() {}
+void IndexTree::read_pages(
+    const std::vector<PendingPage>& batch,
+    const std::function<void(const PendingPage&, const uint8_t*)>& fn)
+{
+    /* shared roaring pages can be listed more than once in a batch */
+    std::vector<bptree::PageID> page_ids;
+    std::vector<size_t> slots;
+
+    for (auto&& pp : batch) {
+        auto it = std::find(page_ids.begin(), page_ids.end(), pp.val.page_id);
+        slots.push_back(it - page_ids.begin());
+        if (it == page_ids.end()) page_ids.push_back(pp.val.page_id);
+    }
+
+    if (page_ids.size() < 2 || !fetch_pool || fetch_pool->empty()) {
+        for (auto&& pp : batch) {
+            boost::upgrade_lock<bptree::Page> lock;
+            auto page = page_cache->fetch_page(pp.val.page_id, lock);
+            assert(page != nullptr);
+
+            fn(pp, page->get_buffer(lock));
+            page_cache->unpin_page(page, false, lock);
+        }
+
+        return;
+    }
+
+    std::vector<FetchWorkerPool::Task> tasks;
+    std::vector<std::future<PageBuffer>> futures;
+    std::vector<PageBuffer> buffers;
+
+    for (auto page_id : page_ids) {
+        tasks.emplace_back([this, page_id] { return copy_page(page_id); });
+        futures.push_back(tasks.back().get_future());
+    }
+    fetch_pool->submit(tasks);
+
+    /* wait for the whole batch so that no task outlives the scan */
+    for (auto&& f : futures) {
+        buffers.push_back(f.get());
+    }
+
+    for (size_t i = 0; i < batch.size(); i++) {
+        fn(batch[i], buffers[slots[i]].get());
+    }
+}
+
+IndexTree::PageBuffer IndexTree::copy_page(bptree::PageID page_id)
+{
+    boost::upgrade_lock<bptree::Page> lock;
+    auto page = page_cache->fetch_page(page_id, lock);
+    assert(page != nullptr);
+
+    auto buf = std::make_unique<uint8_t[]>(page->get_size());
+    ::memcpy(buf.get(), page->get_buffer(lock), page->get_size());
+    page_cache->unpin_page(page, false, lock);
+
+    return buf;
+}
 
 void IndexTree::query_postings(
     const promql::LabelMatcher& matcher, uint64_t start, uint64_t end,
     std::map<unsigned int, std::unique_ptr<uint8_t[]>>& bitmaps,
     const std::set<unsigned int>& seg_mask)
+{
+    /* only run the scans that can find pages of the label name */
+    if (has_page_type(matcher.name, TreePageType::SORTED_LIST, start, end,
+                      seg_mask))
+        query_postings_sorted_list(matcher, start, end, bitmaps, seg_mask);
+
+    if (!has_bitmap_pages(matcher.name, start, end, seg_mask)) return;
+
+    if (is_negative_matcher(matcher)) {
+        query_postings_negative(matcher, start, end, bitmaps, seg_mask);
+    } else {
+        query_postings_bitmap(matcher, start, end, bitmaps, seg_mask);
+    }
+}
+
+void IndexTree::query_postings_negative(
+    const promql::LabelMatcher& matcher, uint64_t start, uint64_t end,
+    std::map<unsigned int, std::unique_ptr<uint8_t[]>>& bitmaps,
+    const std::set<unsigned int>& seg_mask)
+{
+    /* name != value  =>  presence(name) & ~(name == value) */
+    std::map<unsigned int, std::unique_ptr<uint8_t[]>> presence, excluded;
+    std::set<unsigned int> presence_segs;
+    auto page_size = page_cache->get_page_size();
+
+    query_postings_bitmap(
+        {MatchOp::EQL, matcher.name, PRESENCE_LABEL_VALUE}, start, end,
+        presence, seg_mask);
+    if (presence.empty()) return;
+
+    for (auto&& p : presence) {
+        presence_segs.insert(p.first);
+    }
+
+    /* the value of a series never changes so it is excluded even if the
+     * value is only written outside of the time range */
+    query_postings_bitmap({matcher.op == MatchOp::NEQ ? MatchOp::EQL
+                                                      : MatchOp::EQL_REGEX,
+                           matcher.name, matcher.value},
+                          0, UINT64_MAX, excluded, presence_segs);
+
+    for (auto&& p : presence) {
+        auto* bmbuf = p.second.get();
+
+        auto exit = excluded.find(p.first);
+        if (exit != excluded.end()) {
+            bitmap_andnot(bmbuf, exit->second.get(), bmbuf, page_size);
+        }
+
+        auto bmit = bitmaps.find(p.first);
+        if (bmit == bitmaps.end()) {
+            bitmaps.emplace(p.first, std::move(p.second));
+        } else {
+            bitmap_or(bmit->second.get(), bmbuf, bmit->second.get(),
+                      page_size);
+        }
+    }
+}
+
+void IndexTree::query_postings_bitmap(
+    const promql::LabelMatcher& matcher, uint64_t start, uint64_t end,
+    std::map<unsigned int, std::unique_ptr<uint8_t[]>>& bitmaps,
+    const std::set<unsigned int>& seg_mask)
+{
+    Roaring roaring_postings;
+    std::vector<PendingPage> batch;
+
+    auto consume_page = [&](const PendingPage& pp, const uint8_t* p) {
+        if (get_page_type(pp.val) == TreePageType::ROARING) {
+            /* shared page: the value is identified by the item */
+            uint8_t* buf = const_cast<uint8_t*>(p + BITMAP_PAGE_OFFSET);
+            RoaringPageView page_view(buf, page_cache->get_page_size() -
+                                               BITMAP_PAGE_OFFSET);
+            Roaring item_postings;
+
+            if (page_view.get_postings(pp.val.value_ref, pp.segsel,
+                                       item_postings)) {
+                roaring_postings |= item_postings;
+            }
+
+            return;
+        }
+
+        auto page_size = page_cache->get_page_size();
+        auto bmit = bitmaps.find(pp.segsel);
+        if (bmit == bitmaps.end()) {
+            auto bmbuf = std::make_unique<uint8_t[]>(page_size);
+            ::memcpy(bmbuf.get(), p, page_size);
+            bitmaps.emplace(pp.segsel, std::move(bmbuf));
+        } else {
+            auto* bmbuf = bmit->second.get();
+            bitmap_or(bmbuf, p, bmbuf, page_size);
+        }
+    };
+
+    scan_tree_values(matcher, start, end, seg_mask,
+                     [&](const TreeValue& val, unsigned int segsel) {
+                         if (get_page_type(val) == TreePageType::INLINE) {
+                             get_inline_postings(val, segsel,
+                                                 roaring_postings);
+                             return;
+                         }
+
+                         batch.emplace_back(val, segsel);
+                         if (batch.size() == PREFETCH_BATCH) {
+                             read_pages(batch, consume_page);
+                             batch.clear();
+                         }
+                     });
+
+    if (!batch.empty()) read_pages(batch, consume_page);
+
+    if (!roaring_postings.isEmpty())
+        copy_to_bitmaps(roaring_postings, bitmaps, seg_mask);
+}
+
+void IndexTree::scan_tree_values(
+    const promql::LabelMatcher& matcher, uint64_t start, uint64_t end,
+    const std::set<unsigned int>& seg_mask,
+    const std::function<void(const TreeValue&, unsigned int)>& fn)
 {
     KeyType start_key, end_key, match_key;
-    uint8_t name_buf[NAME_BYTES];
     auto op = matcher.op;
     auto name = matcher.name;
     auto value = matcher.value;
-    SymbolTable::Ref value_ref, last_value_ref = 0;
-    bool last_value_matched = false;
+    SymbolTable::Ref name_ref, value_ref = 0, last_value_ref = 0;
+    bool last_value_valid = false, last_value_matched = false;
+    std::vector<RegexLiteral> literals;
+    std::vector<std::pair<KeyType, KeyType>> key_ranges;
+    size_t next_range = 0;
 
     auto* sm = server->get_series_manager();
-    if (matcher.op == promql::MatchOp::NEQ)
-        value_ref = sm->add_symbol(matcher.value);
+    /* no postings are indexed under a symbol that was never added */
+    if (!sm->find_symbol(name, name_ref)) return;
+    if (!sm->find_symbol(value, value_ref) && op == MatchOp::EQL) return;
 
-    query_postings_sorted_list(matcher, start, end, bitmaps, seg_mask);
-
-    match_key = make_key(name, value, 0, 0);
+    match_key = make_key(name_ref, value, 0, UINT32_MAX);
 
+    /* the end keys are inclusive except for LSS */
     switch (op) {
     case MatchOp::EQL:
-        /* key range: from   | hash(name) | hash(value)     | *
-         *              to   | hash(name) | hash(value) + 1 | */
-        start_key = make_key(name, value, 0, UINT32_MAX);
-        end_key = make_key(name, value, end, UINT32_MAX);
+        /* key range: from   | name ref | hash(value) | 0   | *
+         *              to   | name ref | hash(value) | end | */
+        start_key = match_key;
+        end_key = make_key(name_ref, value, end, UINT32_MAX);
         break;
-    case MatchOp::NEQ:
-        /* key range: from   | hash(name)     | 0 | *
-         *              to   | hash(name) + 1 | 0 | */
     case MatchOp::LSS:
-        /* key range: from   | hash(name) |      0      | *
-         *              to   | hash(name) | hash(value) | */
+        /* key range: from   | name ref | 0...        | *
+         *              to   | name ref | hash(value) | (exclusive) */
     case MatchOp::GTR:
-        /* key range: from   | hash(name)     | hash(value) | *
-         *              to   | hash(name) + 1 |      0      | */
+        /* key range: from   | name ref | hash(value) | f... | (exclusive) *
+         *              to   | name ref | f...        |                   */
     case MatchOp::LTE:
-        /* key range: from   | hash(name) |      0      |             *
-         *              to   | hash(name) | hash(value) | (inclusive) */
+        /* key range: from   | name ref | 0...        |      *
+         *              to   | name ref | hash(value) | f... | */
     case MatchOp::GTE:
-        /* key range: from   | hash(name)     | hash(value) | (inclusive) *
-         *              to   | hash(name) + 1 |      0      |             */
+        /* key range: from   | name ref | hash(value) | *
+         *              to   | name ref | f...        | */
     case MatchOp::EQL_REGEX:
-    case MatchOp::NEQ_REGEX:
-        /* key range: from   | hash(name)     | 0 | *
-         *              to   | hash(name) + 1 | 0 | */
+        /* key range: from   | name ref | 0... | *
+         *              to   | name ref | f... | */
         {
-            start_key = make_key(name, value, 0, UINT32_MAX);
-
-            start_key.get_tag_name(name_buf);
-            incr_buf(name_buf, NAME_BYTES);
-            end_key.set_tag_name(name_buf);
-
-            start_key.clear_tag_value();
-            end_key.clear_tag_value();
+            start_key = match_key.first_with_prefix(NAME_BYTES);
+            end_key = match_key.last_with_prefix(NAME_BYTES);
 
-            if (op == MatchOp::LSS || op == MatchOp::LTE) {
+            if (op == MatchOp::LSS) {
                 end_key = match_key;
-            } else if (op == MatchOp::GTR || op == MatchOp::GTE) {
+            } else if (op == MatchOp::LTE) {
+                end_key =
+                    match_key.last_with_prefix(KeyType::TIMESTAMP_OFFSET);
+            } else if (op == MatchOp::GTR) {
+                start_key =
+                    match_key.last_with_prefix(KeyType::TIMESTAMP_OFFSET);
+            } else if (op == MatchOp::GTE) {
                 start_key = match_key;
+            } else if (op == MatchOp::EQL_REGEX &&
+                       extract_regex_literals(value, literals)) {
+                /* only scan the values starting with the literal prefixes */
+                get_regex_key_ranges(name_ref, literals, end, key_ranges);
+                start_key = key_ranges[0].first;
+                end_key = key_ranges[0].second;
+                next_range = 1;
             }
             break;
         }
@@ -159,50 +341,34 @@ void IndexTree::query_postings(
     auto it = cow_tree.begin(start_key);
     while (it != cow_tree.end()) {
         switch (op) {
-        case MatchOp::EQL:
-            if (it->first > end_key) {
-                /* no match */
-                goto out;
-            }
-            break;
-        case MatchOp::NEQ: {
-            KeyType name_value_part = it->first;
-            name_value_part.set_timestamp(0);
-            name_value_part.set_segnum(0);
-
+        case MatchOp::LSS:
             if (it->first >= end_key) {
                 goto out;
-            } else if (name_value_part == match_key) {
-                it++;
-                continue;
             }
             break;
-        }
         case MatchOp::GTR:
             if (it->first == start_key) {
                 it++;
                 continue;
             }
             /* fallthrough */
-        case MatchOp::LSS:
+        case MatchOp::EQL:
+        case MatchOp::LTE:
         case MatchOp::GTE:
-            if (it->first >= end_key) {
-                goto out;
-            }
-            break;
-        case MatchOp::LTE: {
-            KeyType name_value_part = it->first;
-            name_value_part.set_timestamp(0);
-            name_value_part.set_segnum(0);
-
-            if (name_value_part > end_key) {
+            if (it->first > end_key) {
+                /* no match */
                 goto out;
             }
             break;
-        }
         case MatchOp::EQL_REGEX:
-        case MatchOp::NEQ_REGEX:
-            if (it->first >= end_key) {
+            if (it->first > end_key) {
+                if (next_range < key_ranges.size()) {
+                    start_key = key_ranges[next_range].first;
+                    end_key = key_ranges[next_range].second;
+                    next_range++;
+                    it = cow_tree.begin(start_key);
+                    continue;
+                }
                 goto out;
             }
             break;
@@ -215,6 +381,11 @@ void IndexTree::query_postings(
             continue;
         }
 
+        if (is_presence_key(it->first) != (value == PRESENCE_LABEL_VALUE)) {
+            it++;
+            continue;
+        }
+
         unsigned int segsel = it->first.get_segnum();
 
         if (!seg_mask.empty() && seg_mask.find(segsel) == seg_mask.end()) {
@@ -222,67 +393,40 @@ void IndexTree::query_postings(
             continue;
         }
 
-        if (matcher.op == MatchOp::NEQ && it->second.value_ref == value_ref) {
+        /* prune with the leaf data before fetching the page */
+        auto& val = it->second;
+        auto type = get_page_type(val);
+
+        if (type == TreePageType::SORTED_LIST || val.end_timestamp < start) {
             it++;
             continue;
         }
 
-        if ((matcher.op == MatchOp::EQL_REGEX ||
-             matcher.op == MatchOp::NEQ_REGEX) &&
-            it->second.value_ref != 0) {
-            if (it->second.value_ref != last_value_ref) {
-                auto value_str = sm->get_symbol(it->second.value_ref);
+        if (!last_value_valid || val.value_ref != last_value_ref) {
+            last_value_ref = val.value_ref;
+            last_value_valid = true;
 
-                last_value_ref = it->second.value_ref;
-                last_value_matched = matcher.match_value(value_str);
-            }
+            if (op == MatchOp::EQL) {
+                last_value_matched = val.value_ref == value_ref;
+            } else {
+                auto& value_str = sm->get_symbol(val.value_ref);
 
-            if (!last_value_matched) {
-                it++;
-                continue;
+                last_value_matched =
+                    (literals.empty() ||
+                     match_regex_literals(value_str, literals)) &&
+                    matcher.match_value(value_str);
             }
         }
 
-        auto page_id = it->second.page_id;
-        boost::upgrade_lock<bptree::Page> lock;
-        assert(page_id != bptree::Page::INVALID_PAGE_ID);
-        auto page = page_cache->fetch_page(page_id, lock);
-        const uint8_t* p = page->get_buffer(lock);
-
-        promql::Label label;
-        uint64_t end_timestamp;
-        TreePageType type;
-        read_page_metadata(p, label, end_timestamp, type);
-
-        if (type != TreePageType::BITMAP) {
-            page_cache->unpin_page(page, false, lock);
-            it++;
-            continue;
-        }
-
-        if (end_timestamp < start) {
-            page_cache->unpin_page(page, false, lock);
+        if (!last_value_matched) {
             it++;
             continue;
         }
 
-        if (!matcher.match(label)) {
-            page_cache->unpin_page(page, false, lock);
-            it++;
-            continue;
-        }
+        assert(get_page_type(val) == TreePageType::INLINE ||
+               val.page_id != bptree::Page::INVALID_PAGE_ID);
+        fn(val, segsel);
 
-        auto bmit = bitmaps.find(segsel);
-        if (bmit == bitmaps.end()) {
-            auto bmbuf = std::make_unique<uint8_t[]>(page->get_size());
-            ::memcpy(bmbuf.get(), p, page->get_size());
-            bitmaps.emplace(segsel, std::move(bmbuf));
-        } else {
-            auto* bmbuf = bmit->second.get();
-            bitmap_or(bmbuf, p, bmbuf, page->get_size());
-        }
-
-        page_cache->unpin_page(page, false, lock);
         it++;
     }
 
@@ -296,16 +440,88 @@ void IndexTree::query_postings_sorted_list(
     const std::set<unsigned int>& seg_mask)
 {
     Roaring bitmap;
+
+    get_sorted_list_postings(matcher, start, end, bitmap);
+
+    if (bitmap.cardinality()) copy_to_bitmaps(bitmap, bitmaps, seg_mask);
+}
+
+void IndexTree::get_sorted_list_postings(const promql::LabelMatcher& matcher,
+                                         uint64_t start, uint64_t end,
+                                         Roaring& bitmap)
+{
     KeyType start_key, end_key;
-    SymbolTable::Ref value_ref = 0;
+    SymbolTable::Ref name_ref, value_ref = 0;
+    std::vector<RegexLiteral> literals;
+    std::vector<PendingPage> batch;
+    /* only pages that may contain one of these values are read */
+    std::vector<SymbolTable::Ref> lookup_refs;
+    bool lookup = false, has_value_ref = false;
     auto* sm = server->get_series_manager();
 
+    if (!sm->find_symbol(matcher.name, name_ref)) return;
+
     if (matcher.op == promql::MatchOp::EQL ||
         matcher.op == promql::MatchOp::NEQ)
-        value_ref = sm->add_symbol(matcher.value);
+        has_value_ref = sm->find_symbol(matcher.value, value_ref);
+    else if (matcher.op == promql::MatchOp::EQL_REGEX &&
+             extract_regex_literals(matcher.value, literals)) {
+        lookup = std::all_of(literals.begin(), literals.end(),
+                             [](const RegexLiteral& l) { return l.exact; });
+
+        if (lookup) {
+            for (auto&& l : literals) {
+                SymbolTable::Ref ref;
+                if (sm->find_symbol(l.literal, ref)) lookup_refs.push_back(ref);
+            }
+        }
+    }
+
+    if (matcher.op == promql::MatchOp::EQL && has_value_ref) {
+        lookup = true;
+        lookup_refs.push_back(value_ref);
+    }
 
-    start_key = make_key(matcher.name, "", 0, UINT32_MAX);
-    end_key = make_key(matcher.name, "", end, UINT32_MAX);
+    /* none of the values was ever added */
+    if ((matcher.op == promql::MatchOp::EQL && !has_value_ref) ||
+        (lookup && lookup_refs.empty()))
+        return;
+
+    auto consume_page = [&](const PendingPage&, const uint8_t* p) {
+        uint8_t* buf = const_cast<uint8_t*>(p + BITMAP_PAGE_OFFSET);
+        SortedListPageView page_view(buf, page_cache->get_page_size() -
+                                              BITMAP_PAGE_OFFSET);
+
+        std::vector<TSID> series_list;
+        if (matcher.op == promql::MatchOp::EQL) {
+            page_view.get_values(value_ref, series_list);
+        } else {
+            auto name = matcher.name;
+
+            page_view.scan_values(
+                [this, sm, value_ref, has_value_ref, &matcher, &name,
+                 &literals](SymbolTable::Ref ref) {
+                    if (matcher.op == promql::MatchOp::NEQ && has_value_ref &&
+                        ref == value_ref)
+                        return false;
+
+                    auto value = sm->get_symbol(ref);
+                    if (!literals.empty() &&
+                        !match_regex_literals(value, literals))
+                        return false;
+
+                    return matcher.match({name, value});
+                },
+                series_list);
+        }
+
+        for (auto&& p : series_list) {
+            bitmap.add(p);
+        }
+    };
+
+    start_key = make_key(name_ref, "", 0, UINT32_MAX);
+    end_key = make_key(name_ref, "", end, UINT32_MAX);
     start_key.clear_tag_value();
     end_key.clear_tag_value();
 
@@ -320,64 +536,143 @@ void IndexTree::query_postings_sorted_list(
             continue;
         }
 
-        auto page_id = it->second.page_id;
-        boost::upgrade_lock<bptree::Page> lock;
-        assert(page_id != bptree::Page::INVALID_PAGE_ID);
-        auto page = page_cache->fetch_page(page_id, lock);
-        const uint8_t* p = page->get_buffer(lock);
-
-        promql::Label label;
-        uint64_t end_timestamp;
-        TreePageType type;
-        read_page_metadata(p, label, end_timestamp, type);
-
-        if (type != TreePageType::SORTED_LIST) {
-            page_cache->unpin_page(page, false, lock);
+        auto& val = it->second;
+        if (get_page_type(val) != TreePageType::SORTED_LIST ||
+            val.end_timestamp < start) {
             it++;
             continue;
         }
 
-        if (end_timestamp < start) {
-            page_cache->unpin_page(page, false, lock);
+        if (lookup && std::none_of(lookup_refs.begin(), lookup_refs.end(),
+                                   [&val](SymbolTable::Ref ref) {
+                                       return val.may_contain(ref);
+                                   })) {
             it++;
             continue;
         }
 
-        if (label.name != matcher.name) {
-            page_cache->unpin_page(page, false, lock);
-            it++;
+        assert(val.page_id != bptree::Page::INVALID_PAGE_ID);
+        batch.emplace_back(val, it->first.get_segnum());
+        if (batch.size() == PREFETCH_BATCH) {
+            read_pages(batch, consume_page);
+            batch.clear();
+        }
+
+        it++;
+    }
+
+    if (!batch.empty()) read_pages(batch, consume_page);
+}
+
+size_t IndexTree::count_sorted_list_postings(const std::string& name,
+                                             uint64_t start, uint64_t end)
+{
+    KeyType start_key, end_key;
+    size_t count = 0;
+    SymbolTable::Ref name_ref;
+
+    if (!server->get_series_manager()->find_symbol(name, name_ref)) return 0;
+
+    start_key = make_key(name_ref, "", 0, UINT32_MAX);
+    end_key = make_key(name_ref, "", end, UINT32_MAX);
+    start_key.clear_tag_value();
+    end_key.clear_tag_value();
+
+    for (auto it = cow_tree.begin(start_key); it != cow_tree.end(); it++) {
+        if (it->first >= end_key) break;
+        if (it->first.get_timestamp() >= end) continue;
+
+        auto& val = it->second;
+        if (get_page_type(val) != TreePageType::SORTED_LIST ||
+            val.end_timestamp < start)
             continue;
+
+        count += val.num_postings;
+    }
+
+    return count;
+}
+
+size_t IndexTree::estimate_cardinality(
+    const std::vector<promql::LabelMatcher>& matchers, uint64_t start,
+    uint64_t end)
+{
+    /* Postings of the bitmap and roaring pages are bounded per segment and
+     * intersected across the matchers. Sorted list pages are not aligned to
+     * segments so their postings only bound the total of a matcher. */
+    std::map<unsigned int, size_t> seg_counts;
+    std::set<unsigned int> seg_mask;
+    size_t bound = SIZE_MAX;
+    bool first = true;
+
+    for (auto&& p : matchers) {
+        std::map<unsigned int, size_t> counts;
+        size_t total = 0;
+
+        seg_mask.clear();
+        if (!first) {
+            for (auto&& c : seg_counts) {
+                seg_mask.insert(c.first);
+            }
         }
 
-        uint8_t* buf = const_cast<uint8_t*>(p + BITMAP_PAGE_OFFSET);
-        SortedListPageView page_view(buf, page_cache->get_page_size() -
-                                              BITMAP_PAGE_OFFSET);
+        if (has_page_type(p.name, TreePageType::SORTED_LIST, start, end, {}))
+            total = count_sorted_list_postings(p.name, start, end);
+        size_t list_postings = total;
 
-        std::vector<TSID> series_list;
-        if (matcher.op == promql::MatchOp::EQL) {
-            page_view.get_values(value_ref, series_list);
-        } else {
-            auto name = matcher.name;
+        /* name != value selects at most the series with the label name */
+        promql::LabelMatcher matcher = p;
+        if (is_negative_matcher(p))
+            matcher = {MatchOp::EQL, p.name, PRESENCE_LABEL_VALUE};
 
-            page_view.scan_values(
-                [this, sm, value_ref, &matcher, &name](SymbolTable::Ref ref) {
-                    if (matcher.op == promql::MatchOp::NEQ && ref == value_ref)
-                        return false;
+        if (has_bitmap_pages(p.name, start, end, seg_mask)) {
+            scan_tree_values(
+                matcher, start, end, seg_mask,
+                [&counts](const TreeValue& val, unsigned int segsel) {
+                    counts[segsel] += val.num_postings;
+                });
+        }
 
-                    return matcher.match({name, sm->get_symbol(ref)});
-                },
-                series_list);
+        for (auto&& c : counts) {
+            c.second = std::min(c.second, postings_per_page);
+            total += c.second;
         }
 
-        for (auto&& p : series_list) {
-            bitmap.add(p);
+        bound = std::min(bound, total);
+        if (list_postings) continue;
+
+        if (first) {
+            seg_counts = std::move(counts);
+            first = false;
+        } else {
+            auto it1 = seg_counts.begin();
+            auto it2 = counts.begin();
+
+            while ((it1 != seg_counts.end()) && (it2 != counts.end())) {
+                if (it1->first < it2->first) {
+                    it1 = seg_counts.erase(it1);
+                } else if (it2->first < it1->first) {
+                    ++it2;
+                } else {
+                    it1->second = std::min(it1->second, it2->second);
+                    ++it1;
+                    ++it2;
+                }
+            }
+            seg_counts.erase(it1, seg_counts.end());
         }
 
-        page_cache->unpin_page(page, false, lock);
-        it++;
+        if (seg_counts.empty()) return 0;
     }
 
-    if (bitmap.cardinality()) copy_to_bitmaps(bitmap, bitmaps, seg_mask);
+    if (first) return bound == SIZE_MAX ? 0 : bound;
+
+    size_t total = 0;
+    for (auto&& c : seg_counts) {
+        total += c.second;
+    }
+
+    return std::min(bound, total);
 }
 
 void IndexTree::resolve_label_matchers(
@@ -387,6 +682,8 @@ void IndexTree::resolve_label_matchers(
     bool first = true;
     std::map<unsigned int, std::unique_ptr<uint8_t[]>> bitmaps;
     std::set<unsigned int> seg_mask;
+    /* posting pages found by the scans are read after the scans end */
+    COWTreeType::VersionPin pin(&cow_tree);
 
     for (auto&& p : matchers) {
         seg_mask.clear();
@@ -426,79 +723,311 @@ void IndexTree::resolve_label_matchers(
         }
     }
 
-    // collect TSIDs
-    postings = Roaring{};
+    // collect TSIDs
+    postings = Roaring{};
+
+    for (auto&& bm : bitmaps) {
+        auto segsel = bm.first;
+        uint8_t* buf = bm.second.get();
+
+        bitmap_to_roaring(buf + BITMAP_PAGE_OFFSET,
+                          page_cache->get_page_size() - BITMAP_PAGE_OFFSET,
+                          segsel * postings_per_page, postings);
+    }
+}
+
+class IndexTree::SegmentPostingsIterator : public PostingsIterator {
+public:
+    SegmentPostingsIterator(std::shared_ptr<IndexTree> tree,
+                            COWTreeType::VersionPin pin,
+                            std::vector<MatcherPages> matchers,
+                            std::vector<unsigned int> segments)
+        : tree(std::move(tree)), pin(std::move(pin)),
+          matchers(std::move(matchers)),
+          segments(std::move(segments)), next_seg(0), cur_seg(0),
+          it(seg_postings.end()), started(false), valid(false)
+    {}
+
+    virtual bool next()
+    {
+        if (!started) {
+            started = true;
+            return load_segment();
+        }
+
+        if (!valid) return false;
+
+        ++it;
+        if (it != seg_postings.end()) return true;
+
+        return load_segment();
+    }
+
+    virtual bool seek(TSID tsid)
+    {
+        if (started && !valid) return false;
+        if (valid && *it >= tsid) return true;
+
+        /* the postings of a segment are 32-bit */
+        if (tsid > UINT32_MAX) {
+            started = true;
+            valid = false;
+            next_seg = segments.size();
+            return false;
+        }
+
+        auto segsel = tree->tsid_segsel(tsid);
+
+        if (valid && cur_seg == segsel) {
+            it.equalorlarger((uint32_t)tsid);
+            if (it != seg_postings.end()) return true;
+        }
+
+        /* segments before the target are never read */
+        started = true;
+        while (next_seg < segments.size() && segments[next_seg] < segsel)
+            next_seg++;
+
+        while (load_segment()) {
+            if (*it < tsid) it.equalorlarger((uint32_t)tsid);
+            if (it != seg_postings.end()) return true;
+        }
+
+        return false;
+    }
+
+    virtual TSID at() const { return *it; }
+
+private:
+    /* the partition of the tree may be dropped while the iterator is used */
+    std::shared_ptr<IndexTree> tree;
+    /* keep the posting pages from being reused */
+    COWTreeType::VersionPin pin;
+    std::vector<MatcherPages> matchers;
+    std::vector<unsigned int> segments;
+    size_t next_seg;
+    unsigned int cur_seg;
+    Roaring seg_postings;
+    RoaringSetBitForwardIterator it;
+    bool started, valid;
+
+    bool load_segment()
+    {
+        valid = false;
+
+        while (next_seg < segments.size()) {
+            cur_seg = segments[next_seg++];
+            seg_postings = Roaring();
+            tree->read_segment(matchers, cur_seg, seg_postings);
+
+            it = seg_postings.begin();
+            if (it != seg_postings.end()) {
+                valid = true;
+                return true;
+            }
+        }
+
+        return false;
+    }
+};
+
+std::unique_ptr<PostingsIterator>
+IndexTree::get_postings(const std::vector<promql::LabelMatcher>& matchers,
+                        uint64_t start, uint64_t end)
+{
+    std::vector<MatcherPages> plan;
+    std::set<unsigned int> segments;
+    bool first = true;
+    COWTreeType::VersionPin pin(&cow_tree);
+
+    for (auto&& p : matchers) {
+        plan.emplace_back();
+        auto& mp = plan.back();
+        std::set<unsigned int> matcher_segs;
+
+        mp.negative = is_negative_matcher(p);
+        if (has_page_type(p.name, TreePageType::SORTED_LIST, start, end, {}))
+            get_sorted_list_postings(p, start, end, mp.list_postings);
+
+        promql::LabelMatcher matcher = p;
+        if (mp.negative)
+            matcher = {MatchOp::EQL, p.name, PRESENCE_LABEL_VALUE};
+
+        if (has_bitmap_pages(p.name, start, end, segments)) {
+            scan_tree_values(
+                matcher, start, end, segments,
+                [&mp](const TreeValue& val, unsigned int segsel) {
+                    mp.pages[segsel].push_back(val);
+                });
+        }
+
+        for (auto&& pages : mp.pages) {
+            matcher_segs.insert(pages.first);
+        }
+
+        /* excluded values are matched over all time as in
+         * query_postings_negative() */
+        if (mp.negative && !matcher_segs.empty()) {
+            scan_tree_values(
+                {p.op == MatchOp::NEQ ? MatchOp::EQL : MatchOp::EQL_REGEX,
+                 p.name, p.value},
+                0, UINT64_MAX, matcher_segs,
+                [&mp](const TreeValue& val, unsigned int segsel) {
+                    mp.excluded[segsel].push_back(val);
+                });
+        }
+
+        auto it = mp.list_postings.begin();
+        while (it != mp.list_postings.end()) {
+            auto seg = tsid_segsel(*it);
+            uint64_t next_seg_start = (uint64_t)(seg + 1) * postings_per_page;
+
+            matcher_segs.insert(seg);
+
+            if (next_seg_start > UINT32_MAX) break;
+            it.equalorlarger(next_seg_start);
+        }
+
+        if (first) {
+            segments = std::move(matcher_segs);
+            first = false;
+        } else {
+            std::set<unsigned int> isect;
+            std::set_intersection(segments.begin(), segments.end(),
+                                  matcher_segs.begin(), matcher_segs.end(),
+                                  std::inserter(isect, isect.begin()));
+            segments = std::move(isect);
+        }
+
+        if (segments.empty()) break;
+    }
+
+    return std::make_unique<SegmentPostingsIterator>(
+        shared_from_this(), std::move(pin), std::move(plan),
+        std::vector<unsigned int>(segments.begin(), segments.end()));
+}
+
+void IndexTree::read_segment(const std::vector<MatcherPages>& matchers,
+                             unsigned int segsel, Roaring& postings)
+{
+    auto page_size = page_cache->get_page_size();
+    auto result = std::make_unique<uint8_t[]>(page_size);
+    auto bmbuf = std::make_unique<uint8_t[]>(page_size);
+    auto excluded = std::make_unique<uint8_t[]>(page_size);
+    bool first = true;
+
+    for (auto&& mp : matchers) {
+        ::memset(bmbuf.get(), 0, page_size);
+        read_segment_pages(mp.pages, segsel, bmbuf.get());
 
-    for (auto&& bm : bitmaps) {
-        auto segsel = bm.first;
-        uint8_t* buf = bm.second.get();
-        uint8_t* lim = buf + page_cache->get_page_size();
-        uint64_t* pbm = (uint64_t*)(buf + BITMAP_PAGE_OFFSET);
-        size_t start_index = 0;
-        size_t seg_offset = segsel * postings_per_page;
-
-        while (pbm < (uint64_t*)lim) {
-            if (*pbm > 0) {
-                for (uint64_t i = 0; i < 64; i++) {
-                    if ((*pbm) & (1ULL << i)) {
-                        postings.add(seg_offset + start_index + i);
-                    }
-                }
-            }
+        if (mp.negative) {
+            ::memset(excluded.get(), 0, page_size);
+            read_segment_pages(mp.excluded, segsel, excluded.get());
+            bitmap_andnot(bmbuf.get(), excluded.get(), bmbuf.get(), page_size);
+        }
 
-            start_index += 64;
-            pbm++;
+        roaring_to_bitmap(mp.list_postings, segsel * postings_per_page,
+                          bmbuf.get() + BITMAP_PAGE_OFFSET,
+                          page_size - BITMAP_PAGE_OFFSET);
+
+        if (first) {
+            std::swap(result, bmbuf);
+            first = false;
+        } else {
+            bitmap_and(result.get(), bmbuf.get(), result.get(), page_size);
         }
     }
+
+    if (first) return;
+
+    bitmap_to_roaring(result.get() + BITMAP_PAGE_OFFSET,
+                      page_size - BITMAP_PAGE_OFFSET,
+                      segsel * postings_per_page, postings);
 }
 
-void IndexTree::label_values(const std::string& label_name,
-                             std::unordered_set<std::string>& values)
+void IndexTree::read_segment_pages(
+    const std::map<unsigned int, std::vector<TreeValue>>& pages,
+    unsigned int segsel, uint8_t* bmbuf)
 {
-    KeyType start_key, end_key;
-    uint8_t name_buf[NAME_BYTES];
+    auto it = pages.find(segsel);
+    if (it == pages.end()) return;
+
+    auto page_size = page_cache->get_page_size();
+    Roaring roaring_postings;
+    std::vector<PendingPage> batch;
+
+    auto consume_page = [&](const PendingPage& pp, const uint8_t* p) {
+        if (get_page_type(pp.val) == TreePageType::ROARING) {
+            uint8_t* buf = const_cast<uint8_t*>(p + BITMAP_PAGE_OFFSET);
+            RoaringPageView page_view(buf, page_size - BITMAP_PAGE_OFFSET);
+            Roaring item_postings;
+
+            if (page_view.get_postings(pp.val.value_ref, pp.segsel,
+                                       item_postings)) {
+                roaring_postings |= item_postings;
+            }
 
-    start_key = make_key(label_name, "", 0, UINT32_MAX);
+            return;
+        }
 
-    start_key.get_tag_name(name_buf);
-    incr_buf(name_buf, NAME_BYTES);
-    end_key.set_tag_name(name_buf);
+        bitmap_or(bmbuf, p, bmbuf, page_size);
+    };
 
-    start_key.clear_tag_value();
-    end_key.clear_tag_value();
+    for (auto&& val : it->second) {
+        if (get_page_type(val) == TreePageType::INLINE) {
+            get_inline_postings(val, segsel, roaring_postings);
+            continue;
+        }
 
-    auto it = cow_tree.begin(start_key);
-    while (it != cow_tree.end()) {
-        if (it->first >= end_key) {
-            break;
+        batch.emplace_back(val, segsel);
+        if (batch.size() == PREFETCH_BATCH) {
+            read_pages(batch, consume_page);
+            batch.clear();
         }
+    }
 
-        auto page_id = it->second.page_id;
-        boost::upgrade_lock<bptree::Page> lock;
-        assert(page_id != bptree::Page::INVALID_PAGE_ID);
-        auto page = page_cache->fetch_page(page_id, lock);
-        const uint8_t* p = page->get_buffer(lock);
+    if (!batch.empty()) read_pages(batch, consume_page);
 
-        promql::Label label;
-        uint64_t end_timestamp;
-        TreePageType type;
-        read_page_metadata(p, label, end_timestamp, type);
+    roaring_to_bitmap(roaring_postings, segsel * postings_per_page,
+                      bmbuf + BITMAP_PAGE_OFFSET,
+                      page_size - BITMAP_PAGE_OFFSET);
+}
 
-        if (label.name == label_name && type == TreePageType::BITMAP) {
-            values.insert(label.value);
-        }
+void IndexTree::label_values(const std::string& label_name, uint64_t start,
+                             uint64_t end,
+                             std::unordered_set<std::string>& values)
+{
+    auto* sm = server->get_series_manager();
+    SymbolTable::Ref name_ref;
+    std::vector<SymbolTable::Ref> value_refs;
 
-        page_cache->unpin_page(page, false, lock);
-        it++;
+    if (!sm->find_symbol(label_name, name_ref)) return;
+    catalog.get_values(name_ref, start, end, value_refs);
+
+    for (auto ref : value_refs) {
+        values.insert(sm->get_symbol(ref));
+    }
+}
+
+void IndexTree::label_names(uint64_t start, uint64_t end,
+                            std::unordered_set<std::string>& names)
+{
+    auto* sm = server->get_series_manager();
+    std::vector<SymbolTable::Ref> name_refs;
+
+    catalog.get_names(start, end, name_refs);
+
+    for (auto ref : name_refs) {
+        names.insert(sm->get_symbol(ref));
     }
 }
 
-void IndexTree::write_postings_bitmap(TSID limit, const std::string& name,
-                                      const std::string& value,
-                                      const Roaring& bitmap,
-                                      uint64_t min_timestamp,
-                                      uint64_t max_timestamp,
-                                      std::vector<TreeEntry>& tree_entries)
+void IndexTree::write_postings_bitmap(
+    TSID limit, const std::string& name, const std::string& value,
+    const Roaring& bitmap, uint64_t min_timestamp, uint64_t max_timestamp,
+    bptree::Page*& roaring_page,
+    boost::upgrade_lock<bptree::Page>& roaring_lock,
+    std::vector<TreeEntry>& tree_entries)
 {
     if (bitmap.isEmpty()) return;
 
@@ -512,19 +1041,21 @@ void IndexTree::write_postings_bitmap(TSID limit, const std::string& name,
     if (end_it != bitmap.end() && *end_it == limit) end_it++;
 
     bool updated;
-    bptree::PageID pid;
+    TreeValue val, old_val;
     KeyType posting_key;
-    auto* sm = server->get_series_manager();
-    auto value_ref = sm->add_symbol(value);
+    auto name_ref = server->get_series_manager()->add_symbol(name);
+
     for (; it != end_it; it++) {
         auto cur_segsel = tsid_segsel(*it);
 
         if (cur_segsel != left_segsel) {
-            pid = write_posting_page(name, value, min_timestamp, max_timestamp,
-                                     left_segsel, left_it, it, updated);
+            val = write_posting_page(name, value, min_timestamp, max_timestamp,
+                                     left_segsel, left_it, it, roaring_page,
+                                     roaring_lock, updated, old_val);
 
-            posting_key = make_key(name, value, min_timestamp, left_segsel);
-            tree_entries.emplace_back(posting_key, value_ref, pid, updated);
+            posting_key =
+                make_key(name_ref, value, min_timestamp, left_segsel);
+            tree_entries.emplace_back(posting_key, val, updated, old_val);
 
             left_segsel = cur_segsel;
             left_it = it;
@@ -532,23 +1063,28 @@ void IndexTree::write_postings_bitmap(TSID limit, const std::string& name,
     }
 
     if (left_it != end_it) {
-        pid = write_posting_page(name, value, min_timestamp, max_timestamp,
-                                 left_segsel, left_it, end_it, updated);
+        val = write_posting_page(name, value, min_timestamp, max_timestamp,
+                                 left_segsel, left_it, end_it, roaring_page,
+                                 roaring_lock, updated, old_val);
 
-        posting_key = make_key(name, value, min_timestamp, left_segsel);
-        tree_entries.emplace_back(posting_key, value_ref, pid, updated);
+        posting_key = make_key(name_ref, value, min_timestamp, left_segsel);
+        tree_entries.emplace_back(posting_key, val, updated, old_val);
     }
 }
 
 bool IndexTree::get_sorted_list_initial_segment(
     const std::string& name, uint64_t start_time, uint64_t end_time,
     uint32_t& segsel, bptree::Page*& posting_page,
-    boost::upgrade_lock<bptree::Page>& posting_page_lock)
+    boost::upgrade_lock<bptree::Page>& posting_page_lock,
+    TreeValue& reused_val)
 {
     bool updated = false;
+    auto name_ref = server->get_series_manager()->add_symbol(name);
 
-    auto start_key = make_key(name, "", start_time, UINT32_MAX);
+    auto start_key = make_key(name_ref, "", start_time, UINT32_MAX);
     start_key.clear_tag_value();
+    /* all segments of the name starting at start_time */
+    auto end_key = start_key.last_with_prefix(KeyType::SEGNUM_OFFSET);
 
     segsel = 0;
     posting_page = nullptr;
@@ -556,30 +1092,22 @@ bool IndexTree::get_sorted_list_initial_segment(
     auto it = cow_tree.begin(start_key);
 
     while (it != cow_tree.end()) {
-        auto name_timestamp_part = it->first;
-        name_timestamp_part.set_segnum(0);
-        start_key.set_segnum(0);
+        if (it->first > end_key) break;
 
-        if (start_key != name_timestamp_part) break;
+        auto& val = it->second;
+        if (get_page_type(val) != TreePageType::SORTED_LIST) {
+            it++;
+            continue;
+        }
+
+        end_time = std::max(end_time, val.end_timestamp);
 
         boost::upgrade_lock<bptree::Page> plock;
-        auto page_id = it->second.page_id;
-        assert(page_id != bptree::Page::INVALID_PAGE_ID);
-        auto page = page_cache->fetch_page(page_id, plock);
+        assert(val.page_id != bptree::Page::INVALID_PAGE_ID);
+        auto page = page_cache->fetch_page(val.page_id, plock);
         assert(page != nullptr);
 
         const uint8_t* buf = page->get_buffer(plock);
-        promql::Label page_label;
-        uint64_t page_end_timestamp;
-        TreePageType page_type;
-
-        read_page_metadata(buf, page_label, page_end_timestamp, page_type);
-        end_time = std::max(end_time, page_end_timestamp);
-
-        if (page_label.name != name || page_type != TreePageType::SORTED_LIST) {
-            page_cache->unpin_page(page, false, plock);
-            continue;
-        }
 
         posting_page = page_cache->new_page(posting_page_lock);
         boost::upgrade_to_unique_lock<bptree::Page> ulock(posting_page_lock);
@@ -592,6 +1120,7 @@ bool IndexTree::get_sorted_list_initial_segment(
 
         page_cache->unpin_page(page, false, plock);
         segsel = it->first.get_segnum();
+        reused_val = val;
         updated = true;
         break;
     }
@@ -607,111 +1136,151 @@ bool IndexTree::get_sorted_list_initial_segment(
 void IndexTree::write_postings_sorted_list(
     TSID limit, const std::string& name,
     const std::vector<LabeledPostings>& entries,
+    std::unordered_map<SymbolTable::Ref, Roaring>& converted,
     std::vector<TreeEntry>& tree_entries)
 {
     if (entries.empty()) return;
 
     bptree::Page* posting_page = nullptr;
     boost::upgrade_lock<bptree::Page> posting_page_lock;
-    uint64_t min_timestamp, max_timestamp;
+    uint64_t min_timestamp, max_timestamp, page_min_timestamp;
     unsigned int segsel;
-    bool updated, need_init;
+    bool updated;
+    auto* sm = server->get_series_manager();
+    auto name_ref = sm->add_symbol(name);
+    auto page_size = page_cache->get_page_size() - BITMAP_PAGE_OFFSET;
+    TreeValue reused_val;
+    SortedListPageBuilder builder(page_size);
+    std::vector<std::pair<SymbolTable::Ref, TSID>> existing;
+    std::vector<std::pair<SymbolTable::Ref, const LabeledPostings*>> sorted;
 
     min_timestamp = entries.begin()->min_timestamp;
     max_timestamp = entries.begin()->max_timestamp;
 
-    updated = get_sorted_list_initial_segment(name, min_timestamp,
-                                              max_timestamp, segsel,
-                                              posting_page, posting_page_lock);
-    need_init = !updated;
+    updated = get_sorted_list_initial_segment(
+        name, min_timestamp, max_timestamp, segsel, posting_page,
+        posting_page_lock, reused_val);
     assert(posting_page);
 
+    if (updated) {
+        /* merge with the postings of the reused page */
+        const uint8_t* page_buf = posting_page->get_buffer(posting_page_lock);
+        SortedListPageView page_view(
+            const_cast<uint8_t*>(page_buf + BITMAP_PAGE_OFFSET), page_size);
+        page_view.get_postings(existing);
+
+        /* values that became dense are converted to bitmap pages */
+        auto last = std::remove_if(
+            existing.begin(), existing.end(), [&converted](const auto& p) {
+                auto it = converted.find(p.first);
+                if (it == converted.end()) return false;
+
+                it->second.add(p.second);
+                return true;
+            });
+        existing.erase(last, existing.end());
+    }
+
     for (auto&& entry : entries) {
-        auto& value = entry.value;
-        auto& bitmap = entry.postings;
-        auto value_ref = server->get_series_manager()->add_symbol(value);
+        sorted.emplace_back(sm->add_symbol(entry.value), &entry);
+        max_timestamp = std::max(max_timestamp, entry.max_timestamp);
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              [](const auto& a, const auto& b) { return a.first < b.first; });
 
-        auto left_it = bitmap.begin();
+    /* the key of a reused page must not change */
+    page_min_timestamp = min_timestamp;
 
-        auto it = left_it;
-        auto end_it = bitmap.begin();
-        end_it.equalorlarger(limit);
-        if (end_it != bitmap.end() && *end_it == limit) end_it++;
+    auto flush_page = [&]() {
+        size_t num_postings = builder.get_item_count();
+        std::vector<SymbolTable::Ref> value_refs;
 
-        max_timestamp = std::max(max_timestamp, entry.max_timestamp);
+        builder.get_keys(value_refs);
 
-        for (; it != end_it; it++) {
-            {
-                boost::upgrade_to_unique_lock<bptree::Page> ulock(
-                    posting_page_lock);
-                uint8_t* page_buf = posting_page->get_buffer(ulock);
-                uint8_t* buf =
-                    reinterpret_cast<uint8_t*>(page_buf + BITMAP_PAGE_OFFSET);
-
-                SortedListPageView page_view(buf, page_cache->get_page_size() -
-                                                      BITMAP_PAGE_OFFSET);
-
-                if (need_init) {
-                    page_view.init_page();
-                    need_init = false;
-                }
+        {
+            boost::upgrade_to_unique_lock<bptree::Page> ulock(
+                posting_page_lock);
+            uint8_t* page_buf = posting_page->get_buffer(ulock);
 
-                if (page_view.insert(value_ref, *it)) continue;
+            builder.finish(page_buf + BITMAP_PAGE_OFFSET);
+            write_page_metadata(page_buf, {name, ""}, max_timestamp,
+                                TreePageType::SORTED_LIST);
+        }
 
-                write_page_metadata(page_buf, {name, ""}, max_timestamp,
-                                    TreePageType::SORTED_LIST);
-                auto posting_key = make_key(name, value, min_timestamp, segsel);
-                posting_key.clear_tag_value();
-                tree_entries.emplace_back(posting_key, 0,
-                                          posting_page->get_id(), updated);
-                updated = false;
-            }
+        TreeValue val(name_ref, value_refs.front(), posting_page->get_id(),
+                      (uint16_t)TreePageType::SORTED_LIST, max_timestamp,
+                      num_postings);
+        val.max_value_ref = value_refs.back();
+        for (auto&& ref : value_refs) {
+            val.value_filter |= TreeValue::get_filter_bits(ref);
+        }
+
+        auto posting_key = make_key(name_ref, "", page_min_timestamp, segsel);
+        posting_key.clear_tag_value();
+        tree_entries.emplace_back(posting_key, val, updated, reused_val);
+        if (updated) retired_pages.push_back(reused_val.page_id);
+        updated = false;
 
-            page_cache->unpin_page(posting_page, true, posting_page_lock);
+        page_cache->unpin_page(posting_page, true, posting_page_lock);
+        posting_page = nullptr;
+    };
+
+    auto add_posting = [&](SymbolTable::Ref value_ref, TSID tsid,
+                           uint64_t timestamp) {
+        if (!builder.add(value_ref, tsid)) {
+            flush_page();
 
-            min_timestamp = entry.min_timestamp;
             segsel++;
             posting_page = create_posting_page({name, ""}, max_timestamp,
                                                TreePageType::SORTED_LIST,
                                                posting_page_lock);
+            page_min_timestamp = timestamp;
 
-            {
-                boost::upgrade_to_unique_lock<bptree::Page> ulock(
-                    posting_page_lock);
-                uint8_t* page_buf = posting_page->get_buffer(ulock);
-                uint8_t* buf =
-                    reinterpret_cast<uint8_t*>(page_buf + BITMAP_PAGE_OFFSET);
-
-                SortedListPageView page_view(buf, page_cache->get_page_size() -
-                                                      BITMAP_PAGE_OFFSET);
+            assert(builder.add(value_ref, tsid));
+        } else if (!updated) {
+            page_min_timestamp = std::min(page_min_timestamp, timestamp);
+        }
+    };
+
+    size_t next = 0;
+    for (auto&& p : sorted) {
+        auto value_ref = p.first;
+        auto& bitmap = p.second->postings;
+        auto timestamp = p.second->min_timestamp;
+
+        while (next < existing.size() && existing[next].first < value_ref) {
+            add_posting(existing[next].first, existing[next].second,
+                        min_timestamp);
+            next++;
+        }
 
-                page_view.init_page();
+        auto it = bitmap.begin();
+        auto end_it = bitmap.begin();
+        end_it.equalorlarger(limit);
+        if (end_it != bitmap.end() && *end_it == limit) end_it++;
 
-                assert(page_view.insert(value_ref, *it));
+        for (; it != end_it; it++) {
+            while (next < existing.size() &&
+                   existing[next].first == value_ref &&
+                   existing[next].second <= *it) {
+                add_posting(value_ref, existing[next].second, min_timestamp);
+                next++;
             }
+
+            add_posting(value_ref, *it, timestamp);
         }
     }
 
-    {
-        boost::upgrade_to_unique_lock<bptree::Page> ulock(posting_page_lock);
-        uint8_t* page_buf = posting_page->get_buffer(ulock);
-        uint8_t* buf =
-            reinterpret_cast<uint8_t*>(page_buf + BITMAP_PAGE_OFFSET);
-
-        SortedListPageView page_view(buf, page_cache->get_page_size() -
-                                              BITMAP_PAGE_OFFSET);
-
-        if (!need_init && page_view.get_item_count()) {
-            write_page_metadata(page_buf, {name, ""}, max_timestamp,
-                                TreePageType::SORTED_LIST);
-            auto posting_key = make_key(name, "", min_timestamp, segsel);
-            posting_key.clear_tag_value();
-            tree_entries.emplace_back(posting_key, 0, posting_page->get_id(),
-                                      updated);
-        }
+    for (; next < existing.size(); next++) {
+        add_posting(existing[next].first, existing[next].second,
+                    min_timestamp);
     }
 
-    page_cache->unpin_page(posting_page, true, posting_page_lock);
+    if (!builder.empty()) {
+        flush_page();
+    } else {
+        page_cache->unpin_page(posting_page, false, posting_page_lock);
+    }
 }
 
 void IndexTree::write_postings(TSID limit, MemIndexSnapshot& snapshot)
@@ -719,107 +1288,244 @@ void IndexTree::write_postings(TSID limit, MemIndexSnapshot& snapshot)
     std::vector<TreeEntry> tree_entries;
     std::unordered_set<KeyType> keys;
 
+    auto* sm = server->get_series_manager();
+
     for (auto&& entries : snapshot) {
         auto& name = entries.first;
-        auto type = choose_page_type(name, entries.second);
-
-        switch (type) {
-        case TreePageType::SORTED_LIST:
+        auto& bitmap_entries = entries.second;
+        std::vector<LabeledPostings> list_entries;
+        std::unordered_map<SymbolTable::Ref, Roaring> converted;
+        size_t first_entry = tree_entries.size();
+
+        update_label_stats(name, entries.second);
+        update_catalog(limit, name, entries.second);
+
+        /* the layout is chosen for each value */
+        auto list_begin = std::stable_partition(
+            bitmap_entries.begin(), bitmap_entries.end(),
+            [this](const LabeledPostings& p) {
+                return choose_page_type(p) == TreePageType::BITMAP;
+            });
+        list_entries.assign(std::make_move_iterator(list_begin),
+                            std::make_move_iterator(bitmap_entries.end()));
+        bitmap_entries.erase(list_begin, bitmap_entries.end());
+
+        if (!list_entries.empty()) {
             std::sort(
-                entries.second.begin(), entries.second.end(),
+                list_entries.begin(), list_entries.end(),
                 [](const LabeledPostings& lhs, const LabeledPostings& rhs) {
                     return lhs.min_timestamp < rhs.min_timestamp;
                 });
 
-            write_postings_sorted_list(limit, name, entries.second,
+            for (auto&& entry : bitmap_entries) {
+                converted.emplace(sm->add_symbol(entry.value), Roaring{});
+            }
+
+            write_postings_sorted_list(limit, name, list_entries, converted,
                                        tree_entries);
-            break;
-        case TreePageType::BITMAP:
-            for (auto&& entry : entries.second) {
+
+            for (auto&& entry : bitmap_entries) {
+                auto& postings = converted[sm->add_symbol(entry.value)];
+                if (postings.isEmpty()) continue;
+
+                /* moved postings were keyed by the reused page */
+                entry.postings |= postings;
+                entry.min_timestamp = std::min(
+                    entry.min_timestamp, list_entries.front().min_timestamp);
+            }
+        }
+
+        if (!bitmap_entries.empty()) {
+            bptree::Page* roaring_page = nullptr;
+            boost::upgrade_lock<bptree::Page> roaring_lock;
+            Roaring presence;
+            uint64_t presence_min_ts = UINT64_MAX, presence_max_ts = 0;
+
+            for (auto&& entry : bitmap_entries) {
                 auto& value = entry.value;
                 auto& bitmap = entry.postings;
                 auto min_timestamp = entry.min_timestamp;
                 auto max_timestamp = entry.max_timestamp;
 
                 write_postings_bitmap(limit, name, value, bitmap, min_timestamp,
-                                      max_timestamp, tree_entries);
+                                      max_timestamp, roaring_page, roaring_lock,
+                                      tree_entries);
+
+                presence |= bitmap;
+                presence_min_ts = std::min(presence_min_ts, min_timestamp);
+                presence_max_ts = std::max(presence_max_ts, max_timestamp);
             }
 
-            break;
+            /* postings of all series with the label name in bitmap pages for
+             * evaluating negative matchers */
+            write_postings_bitmap(limit, name, PRESENCE_LABEL_VALUE, presence,
+                                  presence_min_ts, presence_max_ts,
+                                  roaring_page, roaring_lock, tree_entries);
+
+            if (roaring_page)
+                page_cache->unpin_page(roaring_page, true, roaring_lock);
         }
+
+        update_page_types(limit, list_entries,
+                          tree_entries.begin() + first_entry,
+                          tree_entries.end());
     }
 
-    COWTreeType::Transaction txn;
-    cow_tree.get_write_tree(txn);
+    std::vector<COWTreeType::MergeEntry> merge_entries;
+    merge_entries.reserve(tree_entries.size());
 
     for (auto&& entry : tree_entries) {
-        assert(entry.pid != bptree::Page::INVALID_PAGE_ID);
-        if (entry.updated) {
-            cow_tree.update(entry.key, {entry.value_ref, entry.pid}, txn);
-        } else {
-            cow_tree.insert(entry.key, {entry.value_ref, entry.pid}, txn);
-        }
+        assert(get_page_type(entry.value) == TreePageType::INLINE ||
+               entry.value.page_id != bptree::Page::INVALID_PAGE_ID);
+
+        /* an update replaces the value whose page is retired and not another
+         * value with the same key */
+        if (entry.updated)
+            merge_entries.emplace_back(entry.key, entry.value,
+                                       entry.old_value);
+        else
+            merge_entries.emplace_back(entry.key, entry.value);
     }
 
-    cow_tree.commit(txn);
+    /* keep the order of entries with equal keys */
+    std::stable_sort(merge_entries.begin(), merge_entries.end());
+
+    /* The catalog may cover more than the tree after a crash but never less.
+     * Scans are skipped and partition time ranges are rebuilt from it. */
+    catalog.flush();
+
+    COWTreeType::Transaction txn;
+    cow_tree.get_write_tree(txn);
+    cow_tree.bulk_merge(merge_entries, txn);
+    auto version = cow_tree.commit(txn);
+
+    auto& tree_pages = txn.get_retired_pages();
+    retired_pages.insert(retired_pages.end(), tree_pages.begin(),
+                         tree_pages.end());
+
+    /* Pages taken from the free list must not be listed as free once the
+     * new version is durable. Pages retired by the new version are only
+     * recorded after that. */
+    page_cache->save();
     page_cache->flush_all_pages();
+
+    page_cache->retire_pages(version, retired_pages);
+    retired_pages.clear();
+    page_cache->reclaim_pages(cow_tree.collect_versions());
+    page_cache->save();
 }
 
-bptree::PageID IndexTree::write_posting_page(
+TreeValue IndexTree::write_posting_page(
     const std::string& name, const std::string& value, uint64_t start_time,
     uint64_t end_time, unsigned int segsel,
     const RoaringSetBitForwardIterator& first,
-    const RoaringSetBitForwardIterator& last, bool& updated)
+    const RoaringSetBitForwardIterator& last, bptree::Page*& roaring_page,
+    boost::upgrade_lock<bptree::Page>& roaring_lock, bool& updated,
+    TreeValue& old_val)
 {
     /* lookup the first page for the label */
     bptree::Page* posting_page = nullptr;
     boost::upgrade_lock<bptree::Page> posting_page_lock;
+    Roaring postings;
+    auto* sm = server->get_series_manager();
+    auto name_ref = sm->add_symbol(name);
+    auto value_ref = sm->add_symbol(value);
+
+    for (auto it = first; it != last; it++) {
+        assert(tsid_segsel(*it) == segsel);
+        postings.add(*it);
+    }
 
-    auto posting_key = make_key(name, value, start_time, segsel);
+    auto posting_key = make_key(name_ref, value, start_time, segsel);
     std::vector<TreeValue> tree_vals;
     cow_tree.get_value(posting_key, tree_vals);
 
     updated = false;
-    if (tree_vals.empty()) {
-        posting_page = create_posting_page(
-            {name, value}, end_time, TreePageType::BITMAP, posting_page_lock);
-    }
+    for (auto&& val : tree_vals) {
+        auto page_type = get_page_type(val);
 
-    if (!posting_page) {
-        for (auto&& val : tree_vals) {
-            boost::upgrade_lock<bptree::Page> plock;
-            assert(val.page_id != bptree::Page::INVALID_PAGE_ID);
-            auto page = page_cache->fetch_page(val.page_id, plock);
-            assert(page != nullptr);
+        if (val.value_ref != value_ref ||
+            page_type == TreePageType::SORTED_LIST) {
+            continue;
+        }
 
-            const uint8_t* buf = page->get_buffer(plock);
-            promql::Label page_label;
-            uint64_t page_end_timestamp;
-            TreePageType page_type;
+        end_time = std::max(end_time, val.end_timestamp);
+
+        if (page_type == TreePageType::INLINE) {
+            get_inline_postings(val, segsel, postings);
+            old_val = val;
+            updated = true;
+            break;
+        }
+
+        boost::upgrade_lock<bptree::Page> plock;
+        assert(val.page_id != bptree::Page::INVALID_PAGE_ID);
+        auto page = page_cache->fetch_page(val.page_id, plock);
+        assert(page != nullptr);
+
+        const uint8_t* buf = page->get_buffer(plock);
 
-            read_page_metadata(buf, page_label, page_end_timestamp, page_type);
-            end_time = std::max(end_time, page_end_timestamp);
+        if (page_type == TreePageType::ROARING) {
+            /* roaring pages are shared so the merged postings are always
+             * written out to a new location */
+            uint8_t* item_buf = const_cast<uint8_t*>(buf + BITMAP_PAGE_OFFSET);
+            RoaringPageView page_view(item_buf, page_cache->get_page_size() -
+                                                    BITMAP_PAGE_OFFSET);
+            Roaring page_postings;
 
-            if (page_label.name != name || page_label.value != value ||
-                page_type != TreePageType::BITMAP) {
+            if (page_view.get_postings(value_ref, segsel, page_postings)) {
+                postings |= page_postings;
                 page_cache->unpin_page(page, false, plock);
-                continue;
+                old_val = val;
+                updated = true;
+                break;
             }
 
-            posting_page = page_cache->new_page(posting_page_lock);
-            boost::upgrade_to_unique_lock<bptree::Page> ulock(
-                posting_page_lock);
+            page_cache->unpin_page(page, false, plock);
+            continue;
+        }
 
-            uint8_t* new_buf = posting_page->get_buffer(ulock);
-            ::memcpy(new_buf, buf, page->get_size());
+        posting_page = page_cache->new_page(posting_page_lock);
+        boost::upgrade_to_unique_lock<bptree::Page> ulock(posting_page_lock);
 
-            write_page_metadata(new_buf, {name, value}, end_time,
-                                TreePageType::BITMAP);
+        uint8_t* new_buf = posting_page->get_buffer(ulock);
+        ::memcpy(new_buf, buf, page->get_size());
 
-            page_cache->unpin_page(page, false, plock);
-            updated = true;
-            break;
+        write_page_metadata(new_buf, {name, value}, end_time,
+                            TreePageType::BITMAP);
+
+        page_cache->unpin_page(page, false, plock);
+        /* the copy replaces the page in the tree entry */
+        retired_pages.push_back(val.page_id);
+        old_val = val;
+        updated = true;
+        break;
+    }
+
+    if (!posting_page && postings.cardinality() <= max_inline_postings) {
+        /* tiny posting lists are looked up without reading a page */
+        uint16_t offsets[TreeValue::MAX_INLINE_POSTINGS];
+        size_t count = 0;
+
+        for (auto&& tsid : postings) {
+            offsets[count++] = (uint16_t)(tsid - segsel * postings_per_page);
         }
+
+        TreeValue val(name_ref, value_ref, bptree::Page::INVALID_PAGE_ID,
+                      (uint16_t)TreePageType::INLINE, end_time, count);
+        val.set_inline_postings(offsets, count);
+        return val;
+    }
+
+    if (!posting_page &&
+        RoaringPageView::get_item_size(postings) <=
+            (page_cache->get_page_size() - BITMAP_PAGE_OFFSET) /
+                ROARING_ITEM_FRACTION) {
+        auto pid = write_roaring_postings(name, value_ref, end_time, segsel,
+                                          postings, roaring_page, roaring_lock);
+        return TreeValue(name_ref, value_ref, pid,
+                         (uint16_t)TreePageType::ROARING, end_time,
+                         postings.cardinality());
     }
 
     if (!posting_page) {
@@ -827,46 +1533,205 @@ bptree::PageID IndexTree::write_posting_page(
             {name, value}, end_time, TreePageType::BITMAP, posting_page_lock);
     }
 
+    size_t num_postings;
     {
         boost::upgrade_to_unique_lock<bptree::Page> ulock(posting_page_lock);
         uint8_t* posting_buf = posting_page->get_buffer(ulock);
-        uint64_t* bitmap =
-            reinterpret_cast<uint64_t*>(posting_buf + BITMAP_PAGE_OFFSET);
 
-        for (auto it = first; it != last; it++) {
-            assert(tsid_segsel(*it) == segsel);
-            size_t bitnum = *it % postings_per_page;
-            bitmap[bitnum >> 6] |= 1ULL << (bitnum & 0x3f);
-        }
+        roaring_to_bitmap(postings, segsel * postings_per_page,
+                          posting_buf + BITMAP_PAGE_OFFSET,
+                          page_cache->get_page_size() - BITMAP_PAGE_OFFSET);
+        num_postings =
+            bitmap_popcount(posting_buf + BITMAP_PAGE_OFFSET,
+                            page_cache->get_page_size() - BITMAP_PAGE_OFFSET);
     }
 
     page_cache->unpin_page(posting_page, true, posting_page_lock);
 
-    return posting_page->get_id();
+    return TreeValue(name_ref, value_ref, posting_page->get_id(),
+                     (uint16_t)TreePageType::BITMAP, end_time, num_postings);
+}
+
+bptree::PageID IndexTree::write_roaring_postings(
+    const std::string& name, SymbolTable::Ref value_ref, uint64_t end_timestamp,
+    unsigned int segsel, const Roaring& postings, bptree::Page*& roaring_page,
+    boost::upgrade_lock<bptree::Page>& roaring_lock)
+{
+    if (roaring_page) {
+        boost::upgrade_to_unique_lock<bptree::Page> ulock(roaring_lock);
+        uint8_t* page_buf = roaring_page->get_buffer(ulock);
+        RoaringPageView page_view(page_buf + BITMAP_PAGE_OFFSET,
+                                  page_cache->get_page_size() -
+                                      BITMAP_PAGE_OFFSET);
+
+        if (page_view.insert(value_ref, segsel, postings)) {
+            promql::Label page_label;
+            uint64_t page_end_timestamp;
+            TreePageType page_type;
+
+            read_page_metadata(page_buf, page_label, page_end_timestamp,
+                               page_type);
+
+            if (page_end_timestamp < end_timestamp) {
+                write_page_metadata(page_buf, page_label, end_timestamp,
+                                    TreePageType::ROARING);
+            }
+
+            return roaring_page->get_id();
+        }
+    }
+
+    if (roaring_page) page_cache->unpin_page(roaring_page, true, roaring_lock);
+
+    roaring_page = create_posting_page({name, ""}, end_timestamp,
+                                       TreePageType::ROARING, roaring_lock);
+
+    {
+        boost::upgrade_to_unique_lock<bptree::Page> ulock(roaring_lock);
+        uint8_t* page_buf = roaring_page->get_buffer(ulock);
+        RoaringPageView page_view(page_buf + BITMAP_PAGE_OFFSET,
+                                  page_cache->get_page_size() -
+                                      BITMAP_PAGE_OFFSET);
+
+        page_view.init_page();
+        assert(page_view.insert(value_ref, segsel, postings));
+    }
+
+    return roaring_page->get_id();
+}
+
+void IndexTree::update_catalog(TSID limit, const std::string& name,
+                               const std::vector<LabeledPostings>& entries)
+{
+    auto* sm = server->get_series_manager();
+    auto name_ref = sm->add_symbol(name);
+
+    for (auto&& p : entries) {
+        /* postings above the limit are not written in this round */
+        if (p.postings.isEmpty() || p.postings.minimum() > limit) continue;
+
+        catalog.add(name_ref, sm->add_symbol(p.value), p.min_timestamp,
+                    p.max_timestamp);
+    }
+}
+
+void IndexTree::update_page_types(TSID limit,
+                                  const std::vector<LabeledPostings>& entries,
+                                  std::vector<TreeEntry>::const_iterator first,
+                                  std::vector<TreeEntry>::const_iterator last)
+{
+    unsigned int list_min_seg = UINT32_MAX, list_max_seg = 0;
+
+    /* sorted list pages are not aligned to segments so they cover the
+     * segments of all postings written */
+    for (auto&& p : entries) {
+        if (p.postings.isEmpty() || p.postings.minimum() > limit) continue;
+
+        TSID max_tsid = std::min<TSID>(p.postings.maximum(), limit);
+
+        list_min_seg =
+            std::min(list_min_seg, tsid_segsel(p.postings.minimum()));
+        list_max_seg = std::max(list_max_seg, tsid_segsel(max_tsid));
+    }
+
+    for (auto it = first; it != last; it++) {
+        auto& val = it->value;
+        auto type = get_page_type(val);
+        unsigned int min_seg, max_seg;
+
+        if (type == TreePageType::SORTED_LIST) {
+            min_seg = list_min_seg;
+            max_seg = list_max_seg;
+        } else {
+            min_seg = max_seg = it->key.get_segnum();
+        }
+
+        catalog.add_page_type(val.name_ref, (uint32_t)type,
+                              it->key.get_timestamp(), val.end_timestamp,
+                              min_seg, max_seg);
+    }
+}
+
+void IndexTree::update_label_stats(const std::string& name,
+                                   const std::vector<LabeledPostings>& entries)
+{
+    size_t num_postings = 0;
+
+    for (auto&& p : entries) {
+        num_postings += p.postings.cardinality();
+    }
+
+    std::unique_lock<std::shared_mutex> lock(stats_mutex);
+    auto& stats = label_stats[name];
+    stats.num_values += entries.size();
+    stats.num_postings += num_postings;
+}
+
+size_t IndexTree::estimate_postings(const promql::LabelMatcher& matcher)
+{
+    std::shared_lock<std::shared_mutex> lock(stats_mutex);
+
+    auto it = label_stats.find(matcher.name);
+    if (it == label_stats.end()) return 0;
+
+    auto& stats = it->second;
+    if (matcher.op == MatchOp::EQL) {
+        /* assume postings are evenly distributed among values */
+        return stats.num_postings / std::max(stats.num_values, (size_t)1);
+    }
+
+    return stats.num_postings;
 }
 
 IndexTree::TreePageType
-IndexTree::choose_page_type(const std::string& tag_name,
-                            const std::vector<LabeledPostings>& entry)
+IndexTree::choose_page_type(const LabeledPostings& entry)
 {
     if (bitmap_only) return TreePageType::BITMAP;
 
+    auto& postings = entry.postings;
+    if (postings.isEmpty()) return TreePageType::SORTED_LIST;
+
     size_t page_size = page_cache->get_page_size();
-    size_t n_vals = entry.size();
-    size_t bitmap_size = n_vals * page_size;
-    size_t sum = 0;
+    size_t item_limit =
+        (page_size - BITMAP_PAGE_OFFSET) / ROARING_ITEM_FRACTION;
+    size_t sorted_size = SortedListPageView::estimate_block_size(
+        postings.cardinality(), postings.minimum(), postings.maximum());
+    size_t entry_size = sizeof(KeyType) + sizeof(TreeValue);
+    size_t bitmap_size = 0;
+    uint64_t prev_rank = 0;
+    bool all_inline = true;
+
+    /* each segment takes a tree entry plus a roaring item or a bitmap page
+     * unless its postings fit in the entry */
+    auto it = postings.begin();
+    while (it != postings.end()) {
+        auto seg = tsid_segsel(*it);
+        uint64_t next_seg_start = (uint64_t)(seg + 1) * postings_per_page;
+        uint64_t rank = next_seg_start > UINT32_MAX
+                            ? postings.cardinality()
+                            : postings.rank(next_seg_start - 1);
+        size_t item_size =
+            ROARING_ITEM_OVERHEAD + (rank - prev_rank) * sizeof(uint16_t);
+
+        bitmap_size += entry_size;
+        if (rank - prev_rank > max_inline_postings) {
+            bitmap_size += item_size <= item_limit ? item_size : page_size;
+            all_inline = false;
+        }
+        if (bitmap_size >= sorted_size + entry_size)
+            return TreePageType::SORTED_LIST;
 
-    for (auto&& p : entry) {
-        sum += p.postings.cardinality();
+        prev_rank = rank;
+        if (next_seg_start > UINT32_MAX) break;
+        it.equalorlarger(next_seg_start);
     }
 
-    size_t sorted_size = sum * (sizeof(TSID) + sizeof(SymbolTable::Ref));
-    if (sorted_size % page_size)
-        sorted_size += page_size - (sorted_size % page_size);
+    /* inline postings save a page read on lookup so they are worth one extra
+     * tree entry */
+    if (all_inline) sorted_size += entry_size;
 
-    if (sorted_size <= bitmap_size) return TreePageType::SORTED_LIST;
-
-    return TreePageType::BITMAP;
+    return bitmap_size >= sorted_size ? TreePageType::SORTED_LIST
+                                      : TreePageType::BITMAP;
 }
 
 size_t IndexTree::read_page_metadata(const uint8_t* buf, promql::Label& label,
@@ -884,8 +1749,11 @@ size_t IndexTree::read_page_metadata(const uint8_t* buf, promql::Label& label,
     buf += sizeof(uint64_t);
 
     type = TreePageType::BITMAP;
-    if (end_timestamp & (1ULL << 63)) type = TreePageType::SORTED_LIST;
-    end_timestamp &= ~(1ULL << 63);
+    if (end_timestamp & SORTED_LIST_PAGE_FLAG)
+        type = TreePageType::SORTED_LIST;
+    else if (end_timestamp & ROARING_PAGE_FLAG)
+        type = TreePageType::ROARING;
+    end_timestamp &= ~PAGE_TYPE_MASK;
 
     label.name = sm->get_symbol(name_ref);
     label.value = sm->get_symbol(value_ref);
@@ -901,8 +1769,11 @@ size_t IndexTree::write_page_metadata(uint8_t* buf, const promql::Label& label,
     auto name_ref = sm->add_symbol(label.name);
     auto value_ref = sm->add_symbol(label.value);
 
-    end_timestamp &= ~(1ULL << 63);
-    if (type == TreePageType::SORTED_LIST) end_timestamp |= (1ULL << 63);
+    end_timestamp &= ~PAGE_TYPE_MASK;
+    if (type == TreePageType::SORTED_LIST)
+        end_timestamp |= SORTED_LIST_PAGE_FLAG;
+    else if (type == TreePageType::ROARING)
+        end_timestamp |= ROARING_PAGE_FLAG;
 
     *(uint32_t*)buf = (uint32_t)name_ref;
     buf += sizeof(uint32_t);
@@ -930,21 +1801,20 @@ IndexTree::create_posting_page(const promql::Label& label,
     return page;
 }
 
-IndexTree::KeyType IndexTree::make_key(const std::string& name,
+IndexTree::KeyType IndexTree::make_key(SymbolTable::Ref name_ref,
                                        const std::string& value,
                                        uint64_t start_time, unsigned int segsel)
 {
     KeyType key;
-    uint8_t name_buf[NAME_BYTES];
     uint8_t value_buf[VALUE_BYTES];
 
-    memset(name_buf, 0, sizeof(name_buf));
     memset(value_buf, 0, sizeof(value_buf));
 
-    _hash_string_name(name, name_buf);
+    /* big-endian so that the keys are ordered by name ref */
+    uint32_t name_buf = __builtin_bswap32(name_ref);
     _hash_string_value(value, value_buf);
 
-    key.set_tag_name(name_buf);
+    key.set_tag_name((uint8_t*)&name_buf);
     key.set_tag_value(value_buf);
     key.set_timestamp(start_time);
     key.set_segnum(segsel);
@@ -952,14 +1822,91 @@ IndexTree::KeyType IndexTree::make_key(const std::string& name,
     return key;
 }
 
-void IndexTree::_hash_string_name(const std::string& str, uint8_t* out)
+bool IndexTree::has_page_type(const std::string& name, TreePageType type,
+                              uint64_t start, uint64_t end,
+                              const std::set<unsigned int>& seg_mask)
+{
+    SymbolTable::Ref name_ref;
+    uint32_t min_seg = 0, max_seg = UINT32_MAX;
+
+    /* nothing is written for a name that was never added */
+    if (!server->get_series_manager()->find_symbol(name, name_ref))
+        return false;
+
+    if (!seg_mask.empty()) {
+        min_seg = *seg_mask.begin();
+        max_seg = *seg_mask.rbegin();
+    }
+
+    return catalog.has_page_type(name_ref, (uint32_t)type, start, end, min_seg,
+                                 max_seg);
+}
+
+IndexTree::TreePageType IndexTree::get_page_type(const TreeValue& val)
+{
+    return static_cast<TreePageType>(val.page_type);
+}
+
+void IndexTree::get_inline_postings(const TreeValue& val, unsigned int segsel,
+                                    Roaring& postings)
+{
+    uint16_t offsets[TreeValue::MAX_INLINE_POSTINGS];
+    TSID seg_start = (TSID)segsel * postings_per_page;
+
+    val.get_inline_postings(offsets);
+    for (size_t i = 0; i < val.num_postings; i++) {
+        postings.add(seg_start + offsets[i]);
+    }
+}
+
+bool IndexTree::is_presence_key(const KeyType& key)
+{
+    uint8_t value_buf[VALUE_BYTES];
+
+    /* label values are valid UTF-8 so no value starts with 0xff */
+    key.get_tag_value(value_buf);
+    return value_buf[0] == (uint8_t)PRESENCE_LABEL_VALUE[0];
+}
+
+void IndexTree::get_regex_key_ranges(
+    SymbolTable::Ref name_ref, const std::vector<RegexLiteral>& literals,
+    uint64_t end, std::vector<std::pair<KeyType, KeyType>>& ranges)
 {
-    /* take LSBs of string hash value */
-    auto str_hash = std::hash<std::string>()(str);
+    /* key range: from   | name ref | prefix | 0... | *
+     *              to   | name ref | prefix | f... | */
+    for (auto&& lit : literals) {
+        KeyType start_key, end_key;
+
+        if (lit.exact) {
+            start_key = make_key(name_ref, lit.literal, 0, UINT32_MAX);
+            end_key = make_key(name_ref, lit.literal, end, UINT32_MAX);
+            ranges.emplace_back(start_key, end_key);
+            continue;
+        }
+
+        start_key = make_key(name_ref, lit.literal, 0, UINT32_MAX);
+
+        /* only the string prefix part of the value bytes is ordered */
+        size_t prefix_len = std::min(lit.literal.length(), VALUE_BYTES - 2);
+        start_key = start_key.first_with_prefix(NAME_BYTES + prefix_len);
+        end_key = start_key.last_with_prefix(NAME_BYTES + prefix_len);
+
+        ranges.emplace_back(start_key, end_key);
+    }
+
+    /* merge overlapping ranges so that no page is visited twice */
+    std::sort(ranges.begin(), ranges.end());
 
-    for (int j = NAME_BYTES - 1; j >= 0; j--) {
-        *out++ = ((uint64_t)str_hash >> (j << 3)) & 0xff;
+    size_t n = 0;
+    for (size_t i = 1; i < ranges.size(); i++) {
+        if (ranges[i].first <= ranges[n].second) {
+            if (ranges[n].second < ranges[i].second)
+                ranges[n].second = ranges[i].second;
+        } else {
+            ranges[++n] = ranges[i];
+        }
     }
+    ranges.resize(n + 1);
 }
 
 void IndexTree::_hash_string_value(const std::string& str, uint8_t* out)
@@ -976,7 +1923,7 @@ void IndexTree::_hash_string_value(const std::string& str, uint8_t* out)
         *out++ = '\0';
     }
 
-    auto str_hash = std::hash<std::string>()(str);
+    auto str_hash = XXH64(str.c_str(), str.length(), 0);
     *out++ = (str_hash >> 8) & 0xff;
     *out++ = str_hash & 0xff;
 }
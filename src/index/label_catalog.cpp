@@ -0,0 +1,339 @@
+#include "tagtree/index/label_catalog.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace tagtree {
+
+LabelCatalog::LabelCatalog(std::string_view filename)
+    : filename(filename), num_records(0)
+{
+    fd = -1;
+
+    open_catalog();
+    load_catalog();
+}
+
+LabelCatalog::~LabelCatalog()
+{
+    if (fd != -1) {
+        ::fsync(fd);
+        ::close(fd);
+    }
+}
+
+void LabelCatalog::add(SymbolTable::Ref name_ref, SymbolTable::Ref value_ref,
+                       uint64_t min_timestamp, uint64_t max_timestamp)
+{
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    update(name_ref, value_ref, min_timestamp, max_timestamp, true);
+}
+
+void LabelCatalog::update(SymbolTable::Ref name_ref, SymbolTable::Ref value_ref,
+                          uint64_t min_timestamp, uint64_t max_timestamp,
+                          bool mark_dirty)
+{
+    auto& entry = names[name_ref];
+    entry.range.update(min_timestamp, max_timestamp);
+
+    if (entry.values[value_ref].update(min_timestamp, max_timestamp) &&
+        mark_dirty) {
+        dirty.emplace_back(name_ref, value_ref);
+    }
+}
+
+void LabelCatalog::add_page_type(SymbolTable::Ref name_ref, uint32_t type,
+                                 uint64_t min_timestamp, uint64_t max_timestamp,
+                                 uint32_t min_segsel, uint32_t max_segsel)
+{
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    auto& entry = names[name_ref].page_types[type];
+
+    bool updated = entry.range.update(min_timestamp, max_timestamp);
+    updated |= entry.segments.update(min_segsel, max_segsel);
+
+    if (updated) dirty_page_types.emplace_back(name_ref, type);
+}
+
+bool LabelCatalog::has_page_type(SymbolTable::Ref name_ref, uint32_t type,
+                                 uint64_t start, uint64_t end,
+                                 uint32_t min_segsel, uint32_t max_segsel)
+{
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    /* a name without page types may have been written before they were
+     * recorded or committed to the tree without a catalog flush */
+    auto it = names.find(name_ref);
+    if (it == names.end() || it->second.page_types.empty()) return true;
+
+    auto pit = it->second.page_types.find(type);
+    if (pit == it->second.page_types.end()) return false;
+
+    return pit->second.range.overlaps(start, end) &&
+           pit->second.segments.overlaps(min_segsel, max_segsel);
+}
+
+void LabelCatalog::get_names(uint64_t start, uint64_t end,
+                             std::vector<SymbolTable::Ref>& names)
+{
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    for (auto&& p : this->names) {
+        if (p.second.range.overlaps(start, end)) names.push_back(p.first);
+    }
+}
+
+void LabelCatalog::get_values(SymbolTable::Ref name_ref, uint64_t start,
+                              uint64_t end,
+                              std::vector<SymbolTable::Ref>& values)
+{
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    auto it = names.find(name_ref);
+    if (it == names.end() || !it->second.range.overlaps(start, end)) return;
+
+    for (auto&& p : it->second.values) {
+        if (p.second.overlaps(start, end)) values.push_back(p.first);
+    }
+}
+
+bool LabelCatalog::get_time_range(uint64_t& min_timestamp,
+                                  uint64_t& max_timestamp)
+{
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    TimeRange range;
+
+    for (auto&& p : names) {
+        auto& r = p.second.range;
+        range.update(r.min_timestamp, r.max_timestamp);
+    }
+
+    min_timestamp = range.min_timestamp;
+    max_timestamp = range.max_timestamp;
+    return !names.empty();
+}
+
+void LabelCatalog::open_catalog()
+{
+    struct stat sbuf;
+    int err = ::stat(filename.c_str(), &sbuf);
+
+    if (err < 0 && errno == ENOENT) {
+        create_catalog();
+        return;
+    }
+
+    if (err < 0) {
+        fd = -1;
+        throw std::runtime_error("unable to get label catalog file status");
+    }
+
+    fd = ::open(filename.c_str(), O_RDWR);
+    if (fd < 0) {
+        fd = -1;
+        throw std::runtime_error("unable to open label catalog file");
+    }
+}
+
+void LabelCatalog::create_catalog()
+{
+    fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_EXCL,
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) {
+        fd = -1;
+        throw std::runtime_error("unable to create label catalog file");
+    }
+
+    lseek(fd, 0, SEEK_SET);
+    uint32_t magic = MAGIC;
+    write(fd, &magic, sizeof(magic));
+}
+
+void LabelCatalog::load_catalog()
+{
+    uint8_t buf[RECORD_SIZE * 128];
+    uint32_t magic;
+    off_t offset = sizeof(magic);
+    struct stat sbuf;
+
+    lseek(fd, 0, SEEK_SET);
+    if (read(fd, &magic, sizeof(magic)) != sizeof(magic) || magic != MAGIC) {
+        throw std::runtime_error("label catalog file corrupted");
+    }
+
+    while (true) {
+        ssize_t buflen = read(fd, buf, sizeof(buf));
+        if (buflen <= 0) break;
+
+        size_t len = buflen - buflen % RECORD_SIZE;
+        if (!len) break;
+
+        for (const uint8_t* p = buf; p < buf + len; p += RECORD_SIZE) {
+            auto name_ref = *(const SymbolTable::Ref*)p;
+            auto value_ref =
+                *(const SymbolTable::Ref*)(p + sizeof(SymbolTable::Ref));
+            auto min_timestamp =
+                *(const uint64_t*)(p + 2 * sizeof(SymbolTable::Ref));
+            auto max_timestamp = *(const uint64_t*)(p + RECORD_SIZE -
+                                                    sizeof(uint64_t));
+
+            if (min_timestamp & RECORD_FLAG_MASK) {
+                auto& entry = names[name_ref].page_types[value_ref];
+                auto& range = (min_timestamp & PAGE_TIME_RECORD_FLAG)
+                                  ? entry.range
+                                  : entry.segments;
+
+                range.update(min_timestamp & ~RECORD_FLAG_MASK, max_timestamp);
+                continue;
+            }
+
+            update(name_ref, value_ref, min_timestamp, max_timestamp, false);
+        }
+
+        offset += len;
+        num_records += len / RECORD_SIZE;
+        /* read the rest of a short read with the next records */
+        if (len != (size_t)buflen) lseek(fd, offset, SEEK_SET);
+    }
+
+    /* drop a partially written record at the end so that the records
+     * appended by flush() stay aligned */
+    if (::fstat(fd, &sbuf) < 0 ||
+        (sbuf.st_size > offset && ::ftruncate(fd, offset) < 0)) {
+        throw std::runtime_error("unable to truncate label catalog file");
+    }
+}
+
+void LabelCatalog::put_record(uint8_t*& p, SymbolTable::Ref name_ref,
+                              uint32_t ref, uint64_t min, uint64_t max)
+{
+    *(SymbolTable::Ref*)p = name_ref;
+    p += sizeof(SymbolTable::Ref);
+    *(SymbolTable::Ref*)p = ref;
+    p += sizeof(SymbolTable::Ref);
+    *(uint64_t*)p = min;
+    p += sizeof(uint64_t);
+    *(uint64_t*)p = max;
+    p += sizeof(uint64_t);
+}
+
+size_t LabelCatalog::get_live_records() const
+{
+    size_t count = 0;
+
+    for (auto&& p : names) {
+        count += p.second.values.size() + 2 * p.second.page_types.size();
+    }
+
+    return count;
+}
+
+void LabelCatalog::flush()
+{
+    std::unique_lock<std::shared_mutex> lock(mutex);
+
+    if (dirty.empty() && dirty_page_types.empty()) return;
+
+    size_t num_dirty = dirty.size() + 2 * dirty_page_types.size();
+
+    /* every update appends a record, so rewrite the catalog once most of
+     * its records are stale */
+    if (num_records + num_dirty >= COMPACT_MIN_RECORDS &&
+        num_records + num_dirty > COMPACT_RATIO * get_live_records()) {
+        compact();
+        return;
+    }
+
+    /* append the latest time ranges of the updated label pairs */
+    std::vector<uint8_t> buf(num_dirty * RECORD_SIZE);
+    uint8_t* p = &buf[0];
+
+    for (auto&& ref : dirty) {
+        auto& range = names[ref.first].values[ref.second];
+        put_record(p, ref.first, ref.second, range.min_timestamp,
+                   range.max_timestamp);
+    }
+
+    for (auto&& ref : dirty_page_types) {
+        auto& entry = names[ref.first].page_types[ref.second];
+        put_record(p, ref.first, ref.second,
+                   entry.range.min_timestamp | PAGE_TIME_RECORD_FLAG,
+                   entry.range.max_timestamp);
+        put_record(p, ref.first, ref.second,
+                   entry.segments.min_timestamp | PAGE_SEGMENT_RECORD_FLAG,
+                   entry.segments.max_timestamp);
+    }
+
+    lseek(fd, 0, SEEK_END);
+    ssize_t retval = write(fd, &buf[0], buf.size());
+    if (retval != (ssize_t)buf.size()) {
+        throw std::runtime_error("failed to write label catalog");
+    }
+
+    num_records += num_dirty;
+    dirty.clear();
+    dirty_page_types.clear();
+    ::fsync(fd);
+}
+
+void LabelCatalog::compact()
+{
+    uint32_t magic = MAGIC;
+    size_t live_records = get_live_records();
+    std::vector<uint8_t> buf(sizeof(magic) + live_records * RECORD_SIZE);
+    uint8_t* p = &buf[0];
+
+    *(uint32_t*)p = magic;
+    p += sizeof(magic);
+
+    for (auto&& name : names) {
+        for (auto&& value : name.second.values) {
+            put_record(p, name.first, value.first, value.second.min_timestamp,
+                       value.second.max_timestamp);
+        }
+
+        for (auto&& pt : name.second.page_types) {
+            auto& entry = pt.second;
+            put_record(p, name.first, pt.first,
+                       entry.range.min_timestamp | PAGE_TIME_RECORD_FLAG,
+                       entry.range.max_timestamp);
+            put_record(p, name.first, pt.first,
+                       entry.segments.min_timestamp | PAGE_SEGMENT_RECORD_FLAG,
+                       entry.segments.max_timestamp);
+        }
+    }
+
+    /* write a new file and rename it over the catalog so that a crash leaves
+     * either the old or the new catalog */
+    auto tmp_filename = filename + ".tmp";
+    int tmp_fd = ::open(tmp_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC,
+                        S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (tmp_fd < 0)
+        throw std::runtime_error("unable to create label catalog file");
+
+    ssize_t retval = write(tmp_fd, &buf[0], buf.size());
+    if (retval != (ssize_t)buf.size()) {
+        ::close(tmp_fd);
+        throw std::runtime_error("failed to write label catalog");
+    }
+
+    ::fsync(tmp_fd);
+
+    if (::rename(tmp_filename.c_str(), filename.c_str()) < 0) {
+        ::close(tmp_fd);
+        throw std::runtime_error("failed to replace label catalog");
+    }
+
+    ::close(fd);
+    fd = tmp_fd;
+    num_records = live_records;
+    dirty.clear();
+    dirty_page_types.clear();
+}
+
+} // namespace tagtree
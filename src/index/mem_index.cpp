@@ -1,7 +1,9 @@
 #include "tagtree/index/mem_index.h"
+#include "tagtree/index/regex_literals.h"
 
 #include "xxhash.h"
 
+#include <algorithm>
 #include <iostream>
 
 namespace tagtree {
@@ -11,7 +13,8 @@ void MemStripe::add(const promql::Label& label, TSID tsid, uint64_t timestamp,
 {
     std::unique_lock<std::shared_mutex> lock(mutex);
 
-    map[label.name][label.value].add(tsid, timestamp, set_next);
+    if (map[label.name][label.value].add(tsid, timestamp, set_next))
+        name_postings[label.name]++;
 
     max_timestamp.store(std::max(max_timestamp.load(), timestamp));
 }
@@ -43,6 +46,11 @@ void MemStripe::get_matcher_postings(const promql::LabelMatcher& matcher,
     }
 
     auto& value_map = name_it->second;
+    if (matcher.op == promql::MatchOp::EQL_REGEX) {
+        get_regex_postings(matcher, value_map, tsids);
+        return;
+    }
+
     for (auto&& p : value_map) {
         if (!matcher.match_value(p.first)) continue;
 
@@ -50,6 +58,49 @@ void MemStripe::get_matcher_postings(const promql::LabelMatcher& matcher,
     }
 }
 
+void MemStripe::get_regex_postings(
+    const promql::LabelMatcher& matcher,
+    const std::unordered_map<std::string, MemPostings>& value_map,
+    MemPostingList& tsids)
+{
+    /* postings of the values matched by the regex (i.e. the excluded values
+     * for NEQ_REGEX) */
+    bool negate = matcher.op == promql::MatchOp::NEQ_REGEX;
+    std::vector<RegexLiteral> literals;
+
+    if (!extract_regex_literals(matcher.value, literals)) {
+        for (auto&& p : value_map) {
+            if (matcher.match_value(p.first) == negate) continue;
+
+            tsids |= p.second.bitmap;
+        }
+        return;
+    }
+
+    bool all_exact = std::all_of(
+        literals.begin(), literals.end(),
+        [](const RegexLiteral& lit) { return lit.exact; });
+
+    if (all_exact && literals.size() < value_map.size()) {
+        /* alternation of literals: look up the values directly */
+        for (auto&& lit : literals) {
+            auto it = value_map.find(lit.literal);
+            if (it == value_map.end()) continue;
+            if (matcher.match_value(it->first) == negate) continue;
+
+            tsids |= it->second.bitmap;
+        }
+        return;
+    }
+
+    for (auto&& p : value_map) {
+        if (!match_regex_literals(p.first, literals)) continue;
+        if (matcher.match_value(p.first) == negate) continue;
+
+        tsids |= p.second.bitmap;
+    }
+}
+
 MemIndex::MemIndex(size_t capacity) : low_watermark(0), current_limit(NO_LIMIT)
 {
     for (int i = 0; i < NUM_STRIPES; i++)
@@ -151,7 +202,7 @@ void MemIndex::resolve_label_matchers_unsafe(
     tsids = MemPostingList{};
 
     for (auto&& p : matchers) {
-        if (p.op != promql::MatchOp::NEQ) positive_matchers++;
+        if (!is_negative_matcher(p)) positive_matchers++;
     }
 
     for (auto&& p : matchers) {
@@ -163,7 +214,7 @@ void MemIndex::resolve_label_matchers_unsafe(
 
         if (tsids.isEmpty()) return;
 
-        if (p.op != promql::MatchOp::NEQ) first = false;
+        if (!is_negative_matcher(p)) first = false;
     }
 
     if (!exclude.isEmpty()) {
@@ -218,6 +269,14 @@ void MemStripe::resolve_label_matcher(const promql::LabelMatcher& matcher,
 
             *exclude |= value_it->second.bitmap;
         }
+    } else if (matcher.op == promql::MatchOp::NEQ_REGEX && exclude) {
+        /* subtract the values matched by the regex */
+        auto name_it = map.find(matcher.name);
+        if (name_it == map.end()) {
+            return;
+        }
+
+        get_regex_postings(matcher, name_it->second, *exclude);
     } else {
         MemPostingList postings;
 
@@ -231,26 +290,87 @@ void MemStripe::resolve_label_matcher(const promql::LabelMatcher& matcher,
     }
 }
 
-void MemIndex::label_values(const std::string& label_name,
+size_t MemIndex::estimate_postings(const promql::LabelMatcher& matcher)
+{
+    promql::Label label{matcher.name, matcher.value};
+    return get_stripe(label).estimate_postings(matcher);
+}
+
+size_t MemStripe::estimate_postings(const promql::LabelMatcher& matcher)
+{
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    if (matcher.op == promql::MatchOp::EQL) {
+        auto name_it = map.find(matcher.name);
+        if (name_it == map.end()) return 0;
+
+        auto& value_map = name_it->second;
+        auto value_it = value_map.find(matcher.value);
+        if (value_it == value_map.end()) return 0;
+
+        return value_it->second.bitmap.cardinality();
+    }
+
+    auto it = name_postings.find(matcher.name);
+    if (it == name_postings.end()) return 0;
+
+    return it->second;
+}
+
+void MemIndex::label_values(const std::string& label_name, uint64_t start,
+                            uint64_t end,
                             std::unordered_set<std::string>& values)
 {
     promql::Label label{label_name, ""};
-    get_stripe(label).label_values(label_name, values);
+    get_stripe(label).label_values(label_name, start, end, values);
 }
 
-void MemStripe::label_values(const std::string& label_name,
+void MemIndex::label_names(uint64_t start, uint64_t end,
+                           std::unordered_set<std::string>& names)
+{
+    for (auto& stripe : stripes)
+        stripe.label_names(start, end, names);
+}
+
+static inline bool postings_in_range(const MemPostings& postings,
+                                     uint64_t end)
+{
+    return std::min(postings.min_timestamp, postings.next_timestamp) <= end;
+}
+
+void MemStripe::label_values(const std::string& label_name, uint64_t start,
+                             uint64_t end,
                              std::unordered_set<std::string>& values)
 {
     std::shared_lock<std::shared_mutex> lock(mutex);
 
+    if (max_timestamp.load() < start) return;
+
     auto it = map.find(label_name);
     if (it != map.end()) {
         for (auto&& value : it->second) {
-            values.insert(value.first);
+            if (postings_in_range(value.second, end))
+                values.insert(value.first);
         }
     }
 }
 
+void MemStripe::label_names(uint64_t start, uint64_t end,
+                            std::unordered_set<std::string>& names)
+{
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    if (max_timestamp.load() < start) return;
+
+    for (auto&& p : map) {
+        if (std::any_of(p.second.begin(), p.second.end(),
+                        [end](const auto& value) {
+                            return postings_in_range(value.second, end);
+                        }))
+            names.insert(p.first);
+    }
+}
+
 uint64_t MemIndex::snapshot(TSID limit, MemIndexSnapshot& snapshot)
 {
     uint64_t max_time = 0;
@@ -308,6 +428,7 @@ void MemStripe::gc(TSID low_watermark)
 
     for (auto name_it = map.begin(); name_it != map.end();) {
         auto& name_map = name_it->second;
+        size_t num_postings = 0;
 
         for (auto value_it = name_map.begin(); value_it != name_map.end();) {
             auto& bitmap = value_it->second.bitmap;
@@ -329,13 +450,16 @@ void MemStripe::gc(TSID low_watermark)
 
             value_it->second.min_timestamp = value_it->second.next_timestamp;
             value_it->second.next_timestamp = UINT64_MAX;
+            num_postings += value_it->second.bitmap.cardinality();
 
             value_it++;
         }
 
         if (name_map.empty()) {
+            name_postings.erase(name_it->first);
             name_it = map.erase(name_it);
         } else {
+            name_postings[name_it->first] = num_postings;
             name_it++;
         }
     }
@@ -0,0 +1,301 @@
+#include "tagtree/index/partitioned_index_tree.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+namespace tagtree {
+
+PartitionedIndexTree::PartitionedIndexTree(IndexServer* server,
+                                           std::string_view index_dir,
+                                           size_t cache_size, bool bitmap_only,
+                                           uint64_t partition_duration)
+    : server(server), index_dir(index_dir), cache_size(cache_size),
+      bitmap_only(bitmap_only), partition_duration(partition_duration),
+      fetch_pool(std::make_shared<FetchWorkerPool>(std::min(
+          MAX_FETCH_WORKERS, std::thread::hardware_concurrency())))
+{
+    if (!partition_duration)
+        throw std::invalid_argument("partition duration must be positive");
+
+    version.store(0);
+    open_partitions();
+}
+
+std::string PartitionedIndexTree::get_partition_filename(uint64_t bucket)
+{
+    return index_dir + "/index-" + std::to_string(bucket) + ".db";
+}
+
+void PartitionedIndexTree::open_partitions()
+{
+    static const char prefix[] = "index-";
+    static const char suffix[] = ".db";
+    DIR* dirp;
+    struct dirent* entry;
+    std::vector<uint64_t> buckets;
+
+    /* the unpartitioned index of older versions uses another key format and
+     * cannot be migrated */
+    if (::access((index_dir + "/index.db").c_str(), F_OK) == 0)
+        throw std::runtime_error(
+            "unpartitioned index file found, rebuild the index");
+
+    dirp = opendir(index_dir.c_str());
+    if (!dirp) return;
+
+    while ((entry = readdir(dirp))) {
+        const char* name = entry->d_name;
+        char* end;
+
+        if (::strncmp(name, prefix, sizeof(prefix) - 1)) continue;
+        uint64_t bucket = ::strtoull(name + sizeof(prefix) - 1, &end, 10);
+        if (end == name + sizeof(prefix) - 1 || ::strcmp(end, suffix))
+            continue;
+
+        /* some file systems do not report the entry type */
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (::stat((index_dir + "/" + name).c_str(), &st) < 0 ||
+                !S_ISREG(st.st_mode))
+                continue;
+        } else if (entry->d_type != DT_REG)
+            continue;
+
+        buckets.push_back(bucket);
+    }
+
+    closedir(dirp);
+
+    for (auto bucket : buckets) {
+        open_partition(bucket, buckets.size());
+    }
+}
+
+PartitionedIndexTree::Partition&
+PartitionedIndexTree::open_partition(uint64_t bucket, size_t num_partitions)
+{
+    auto it = partitions.find(bucket);
+    if (it != partitions.end()) return it->second;
+
+    Partition part;
+    part.filename = get_partition_filename(bucket);
+    part.tree = std::make_shared<IndexTree>(
+        server, part.filename, get_partition_cache_size(num_partitions),
+        bitmap_only, fetch_pool);
+
+    /* empty partitions never overlap a query */
+    part.tree->get_time_range(part.min_timestamp, part.max_timestamp);
+
+    return partitions.emplace(bucket, std::move(part)).first->second;
+}
+
+size_t
+PartitionedIndexTree::get_partition_cache_size(size_t num_partitions) const
+{
+    return std::max(cache_size / std::max(num_partitions, (size_t)1),
+                    MIN_PARTITION_CACHE_SIZE);
+}
+
+void PartitionedIndexTree::rebalance_caches()
+{
+    /* the page caches keep the share given when they are opened */
+    auto share = get_partition_cache_size(partitions.size());
+
+    for (auto&& p : partitions) {
+        p.second.tree->set_cache_size(share);
+    }
+}
+
+void PartitionedIndexTree::get_trees(
+    uint64_t start, uint64_t end,
+    std::vector<std::shared_ptr<IndexTree>>& trees)
+{
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    for (auto&& p : partitions) {
+        if (p.second.overlaps(start, end)) trees.push_back(p.second.tree);
+    }
+}
+
+void PartitionedIndexTree::write_postings(TSID limit,
+                                          MemIndexSnapshot& snapshot)
+{
+    uint64_t min_timestamp = UINT64_MAX, max_timestamp = 0;
+
+    for (auto&& entries : snapshot) {
+        for (auto&& entry : entries.second) {
+            min_timestamp = std::min(min_timestamp, entry.min_timestamp);
+            max_timestamp = std::max(max_timestamp, entry.max_timestamp);
+        }
+    }
+
+    if (min_timestamp > max_timestamp) return;
+
+    auto bucket = max_timestamp - max_timestamp % partition_duration;
+    std::shared_ptr<IndexTree> tree;
+
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        bool created = partitions.find(bucket) == partitions.end();
+        auto num_partitions = partitions.size() + (created ? 1 : 0);
+
+        tree = open_partition(bucket, num_partitions).tree;
+        if (created) rebalance_caches();
+    }
+
+    tree->write_postings(limit, snapshot);
+
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto it = partitions.find(bucket);
+
+        /* the partition may have been dropped in between */
+        if (it != partitions.end() && it->second.tree == tree) {
+            auto& part = it->second;
+            part.min_timestamp = std::min(part.min_timestamp, min_timestamp);
+            part.max_timestamp = std::max(part.max_timestamp, max_timestamp);
+        }
+    }
+
+    version++;
+}
+
+void PartitionedIndexTree::resolve_label_matchers(
+    const std::vector<promql::LabelMatcher>& matchers, uint64_t start,
+    uint64_t end, Roaring& postings)
+{
+    std::vector<std::shared_ptr<IndexTree>> trees;
+    get_trees(start, end, trees);
+
+    postings = Roaring{};
+
+    for (auto&& tree : trees) {
+        Roaring tree_postings;
+        tree->resolve_label_matchers(matchers, start, end, tree_postings);
+        postings |= tree_postings;
+    }
+}
+
+std::unique_ptr<PostingsIterator> PartitionedIndexTree::get_postings(
+    const std::vector<promql::LabelMatcher>& matchers, uint64_t start,
+    uint64_t end)
+{
+    std::vector<std::shared_ptr<IndexTree>> trees;
+    std::unique_ptr<PostingsIterator> postings;
+
+    get_trees(start, end, trees);
+
+    for (auto&& tree : trees) {
+        auto tree_postings = tree->get_postings(matchers, start, end);
+
+        if (postings) {
+            postings = std::make_unique<MergedPostingsIterator>(
+                std::move(postings), std::move(tree_postings));
+        } else {
+            postings = std::move(tree_postings);
+        }
+    }
+
+    if (!postings)
+        postings = std::make_unique<RoaringPostingsIterator>(Roaring{});
+
+    return postings;
+}
+
+void PartitionedIndexTree::label_values(const std::string& label_name,
+                                        uint64_t start, uint64_t end,
+                                        std::unordered_set<std::string>& values)
+{
+    std::vector<std::shared_ptr<IndexTree>> trees;
+    get_trees(start, end, trees);
+
+    for (auto&& tree : trees) {
+        tree->label_values(label_name, start, end, values);
+    }
+}
+
+void PartitionedIndexTree::label_names(uint64_t start, uint64_t end,
+                                       std::unordered_set<std::string>& names)
+{
+    std::vector<std::shared_ptr<IndexTree>> trees;
+    get_trees(start, end, trees);
+
+    for (auto&& tree : trees) {
+        tree->label_names(start, end, names);
+    }
+}
+
+size_t
+PartitionedIndexTree::estimate_postings(const promql::LabelMatcher& matcher)
+{
+    std::vector<std::shared_ptr<IndexTree>> trees;
+    size_t count = 0;
+
+    get_trees(0, UINT64_MAX, trees);
+
+    for (auto&& tree : trees) {
+        count += tree->estimate_postings(matcher);
+    }
+
+    return count;
+}
+
+size_t PartitionedIndexTree::estimate_cardinality(
+    const std::vector<promql::LabelMatcher>& matchers, uint64_t start,
+    uint64_t end)
+{
+    std::vector<std::shared_ptr<IndexTree>> trees;
+    size_t count = 0;
+
+    get_trees(start, end, trees);
+
+    for (auto&& tree : trees) {
+        count += tree->estimate_cardinality(matchers, start, end);
+    }
+
+    return count;
+}
+
+size_t PartitionedIndexTree::drop_partitions(uint64_t timestamp)
+{
+    std::vector<std::string> filenames;
+
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+
+        for (auto it = partitions.begin(); it != partitions.end();) {
+            auto& part = it->second;
+
+            /* the partition of the current time bucket is still written */
+            if (part.max_timestamp >= timestamp ||
+                it->first + partition_duration > timestamp) {
+                it++;
+                continue;
+            }
+
+            filenames.push_back(part.filename);
+            it = partitions.erase(it);
+        }
+
+        if (!filenames.empty()) rebalance_caches();
+    }
+
+    /* running queries keep their trees open until they finish */
+    for (auto&& filename : filenames) {
+        ::unlink(filename.c_str());
+        ::unlink((filename + ".catalog").c_str());
+        ::unlink((filename + ".free").c_str());
+    }
+
+    if (!filenames.empty()) version++;
+
+    return filenames.size();
+}
+
+} // namespace tagtree
@@ -0,0 +1,91 @@
+#include "tagtree/index/postings.h"
+
+#include <algorithm>
+
+namespace tagtree {
+
+RoaringPostingsIterator::RoaringPostingsIterator(MemPostingList postings)
+    : postings(std::move(postings)), it(this->postings.begin()),
+      started(false)
+{}
+
+bool RoaringPostingsIterator::next()
+{
+    if (!started) {
+        started = true;
+    } else if (it != postings.end()) {
+        ++it;
+    }
+
+    return it != postings.end();
+}
+
+bool RoaringPostingsIterator::seek(TSID tsid)
+{
+    started = true;
+    if (it == postings.end()) return false;
+    if (*it >= tsid) return true;
+
+    if (tsid > UINT32_MAX) {
+        it = postings.end();
+        return false;
+    }
+
+    it.equalorlarger((uint32_t)tsid);
+    return it != postings.end();
+}
+
+MergedPostingsIterator::MergedPostingsIterator(
+    std::unique_ptr<PostingsIterator> a, std::unique_ptr<PostingsIterator> b)
+    : a(std::move(a)), b(std::move(b)), a_valid(false), b_valid(false),
+      started(false), cur(0)
+{}
+
+bool MergedPostingsIterator::update()
+{
+    if (a_valid && b_valid) {
+        cur = std::min(a->at(), b->at());
+    } else if (a_valid) {
+        cur = a->at();
+    } else if (b_valid) {
+        cur = b->at();
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+bool MergedPostingsIterator::next()
+{
+    if (!started) {
+        started = true;
+        a_valid = a->next();
+        b_valid = b->next();
+        return update();
+    }
+
+    /* advance both sides if they are on the same TSID */
+    if (a_valid && a->at() == cur) a_valid = a->next();
+    if (b_valid && b->at() == cur) b_valid = b->next();
+
+    return update();
+}
+
+bool MergedPostingsIterator::seek(TSID tsid)
+{
+    if (started && (a_valid || b_valid) && cur >= tsid) return true;
+
+    if (!started) {
+        started = true;
+        a_valid = a->seek(tsid);
+        b_valid = b->seek(tsid);
+    } else {
+        if (a_valid) a_valid = a->seek(tsid);
+        if (b_valid) b_valid = b->seek(tsid);
+    }
+
+    return update();
+}
+
+} // namespace tagtree
@@ -0,0 +1,164 @@
+#include "tagtree/index/regex_literals.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+namespace tagtree {
+
+static const char* REGEX_META_CHARS = ".[]()*+?{}^$|";
+
+/* strip a group that encloses the whole regex */
+static std::string strip_group(const std::string& regex)
+{
+    if (regex.size() < 2 || regex.front() != '(' || regex.back() != ')')
+        return regex;
+
+    int depth = 0;
+    bool in_class = false;
+
+    for (size_t i = 0; i < regex.size(); i++) {
+        char c = regex[i];
+
+        if (c == '\\') {
+            i++;
+            continue;
+        }
+
+        if (in_class) {
+            if (c == ']') in_class = false;
+            continue;
+        }
+
+        if (c == '[') {
+            in_class = true;
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            depth--;
+            /* the first group closes before the end */
+            if (depth == 0 && i != regex.size() - 1) return regex;
+        }
+    }
+
+    std::string inner = regex.substr(1, regex.size() - 2);
+    if (inner.compare(0, 2, "?:") == 0) {
+        inner = inner.substr(2);
+    } else if (!inner.empty() && inner[0] == '?') {
+        /* flags or named group */
+        return regex;
+    }
+
+    return strip_group(inner);
+}
+
+static bool split_alternatives(const std::string& regex,
+                               std::vector<std::string>& branches)
+{
+    int depth = 0;
+    bool in_class = false;
+    size_t start = 0;
+
+    for (size_t i = 0; i < regex.size(); i++) {
+        char c = regex[i];
+
+        if (c == '\\') {
+            i++;
+            continue;
+        }
+
+        if (in_class) {
+            if (c == ']') in_class = false;
+            continue;
+        }
+
+        if (c == '[') {
+            in_class = true;
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            depth--;
+        } else if (c == '|' && depth == 0) {
+            branches.push_back(regex.substr(start, i - start));
+            start = i + 1;
+        }
+    }
+
+    if (depth != 0 || in_class) return false;
+
+    branches.push_back(regex.substr(start));
+    return true;
+}
+
+static RegexLiteral extract_branch_literal(const std::string& branch)
+{
+    std::string literal;
+    size_t i = 0;
+
+    while (i < branch.size()) {
+        char c = branch[i];
+
+        if (c == '\\') {
+            /* escape sequences like \d or \b are not literals */
+            if (i + 1 >= branch.size() ||
+                std::isalnum((unsigned char)branch[i + 1]))
+                break;
+
+            c = branch[i + 1];
+            i += 2;
+        } else if (::strchr(REGEX_META_CHARS, c)) {
+            break;
+        } else {
+            i++;
+        }
+
+        if (i < branch.size() &&
+            (branch[i] == '*' || branch[i] == '?' || branch[i] == '{')) {
+            /* the last character is optional or repeated */
+            return RegexLiteral(literal, false);
+        }
+
+        literal.push_back(c);
+    }
+
+    return RegexLiteral(literal, i == branch.size());
+}
+
+bool extract_regex_literals(const std::string& regex,
+                            std::vector<RegexLiteral>& literals)
+{
+    std::vector<std::string> branches;
+
+    literals.clear();
+
+    if (!split_alternatives(strip_group(regex), branches)) return false;
+
+    for (auto&& branch : branches) {
+        auto lit = extract_branch_literal(branch);
+
+        if (!lit.exact && lit.literal.empty()) {
+            literals.clear();
+            return false;
+        }
+
+        literals.push_back(std::move(lit));
+    }
+
+    return true;
+}
+
+bool match_regex_literals(const std::string& value,
+                          const std::vector<RegexLiteral>& literals)
+{
+    for (auto&& lit : literals) {
+        if (lit.exact) {
+            if (value == lit.literal) return true;
+        } else if (value.compare(0, lit.literal.size(), lit.literal) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+} // namespace tagtree
@@ -40,6 +40,17 @@ SymbolTable::Ref SymbolTable::add_symbol(std::string_view symbol)
     return it->second;
 }
 
+bool SymbolTable::find_symbol(std::string_view symbol, Ref& ref)
+{
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    auto it = symbol_map.find(symbol.data());
+
+    if (it == symbol_map.end()) return false;
+
+    ref = it->second;
+    return true;
+}
+
 const std::string& SymbolTable::get_symbol(Ref ref)
 {
     std::shared_lock<std::shared_mutex> lock(mutex);
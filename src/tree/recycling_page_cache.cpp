@@ -0,0 +1,164 @@
+#include "tagtree/tree/recycling_page_cache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace tagtree {
+
+RecyclingPageCache::RecyclingPageCache(
+    std::unique_ptr<bptree::AbstractPageCache> cache, std::string_view filename)
+    : cache(std::move(cache)), filename(filename)
+{
+    load();
+}
+
+bptree::Page*
+RecyclingPageCache::new_page(boost::upgrade_lock<bptree::Page>& lock)
+{
+    bptree::PageID pid = bptree::Page::INVALID_PAGE_ID;
+
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        if (!free_pages.empty()) {
+            pid = free_pages.back();
+            free_pages.pop_back();
+        }
+    }
+
+    if (pid == bptree::Page::INVALID_PAGE_ID) return cache->new_page(lock);
+
+    auto page = cache->fetch_page(pid, lock);
+    if (!page) return cache->new_page(lock);
+
+    /* reused pages look like new pages */
+    {
+        boost::upgrade_to_unique_lock<bptree::Page> ulock(lock);
+        ::memset(page->get_buffer(ulock), 0, page->get_size());
+    }
+
+    return page;
+}
+
+bptree::Page*
+RecyclingPageCache::fetch_page(bptree::PageID id,
+                               boost::upgrade_lock<bptree::Page>& lock)
+{
+    return cache->fetch_page(id, lock);
+}
+
+void RecyclingPageCache::unpin_page(bptree::Page* page, bool dirty,
+                                    boost::upgrade_lock<bptree::Page>& lock)
+{
+    cache->unpin_page(page, dirty, lock);
+}
+
+void RecyclingPageCache::flush_all_pages() { cache->flush_all_pages(); }
+
+size_t RecyclingPageCache::get_page_size() const
+{
+    return cache->get_page_size();
+}
+
+void RecyclingPageCache::retire_pages(uint32_t version,
+                                      const std::vector<bptree::PageID>& pages)
+{
+    if (pages.empty()) return;
+
+    std::lock_guard<std::mutex> guard(mutex);
+    auto& retired = retired_pages[version];
+    retired.insert(retired.end(), pages.begin(), pages.end());
+}
+
+void RecyclingPageCache::reclaim_pages(uint32_t version)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+
+    auto it = retired_pages.begin();
+    while (it != retired_pages.end() && it->first <= version) {
+        free_pages.insert(free_pages.end(), it->second.begin(),
+                          it->second.end());
+        it = retired_pages.erase(it);
+    }
+}
+
+size_t RecyclingPageCache::get_num_free_pages()
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    return free_pages.size();
+}
+
+void RecyclingPageCache::load()
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return;
+
+    uint32_t magic;
+    if (::read(fd, &magic, sizeof(magic)) != sizeof(magic) || magic != MAGIC) {
+        ::close(fd);
+        throw std::runtime_error("free page list corrupted");
+    }
+
+    uint32_t buf[256];
+    while (true) {
+        ssize_t buflen = ::read(fd, buf, sizeof(buf));
+        if (buflen <= 0) break;
+
+        for (size_t i = 0; i + 1 < buflen / sizeof(uint32_t); i += 2) {
+            if (buf[i])
+                retired_pages[buf[i]].push_back(buf[i + 1]);
+            else
+                free_pages.push_back(buf[i + 1]);
+        }
+
+        if (buflen % (2 * sizeof(uint32_t))) break;
+    }
+
+    ::close(fd);
+}
+
+void RecyclingPageCache::save()
+{
+    std::vector<uint32_t> buf;
+
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        buf.push_back((uint32_t)MAGIC);
+        for (auto&& pid : free_pages) {
+            buf.push_back(0);
+            buf.push_back(pid);
+        }
+        for (auto&& p : retired_pages) {
+            for (auto&& pid : p.second) {
+                buf.push_back(p.first);
+                buf.push_back(pid);
+            }
+        }
+    }
+
+    /* replace the old list atomically */
+    auto tmp_filename = filename + ".tmp";
+    int fd = ::open(tmp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) throw std::runtime_error("unable to create free page list");
+
+    size_t len = buf.size() * sizeof(uint32_t);
+    if (::write(fd, &buf[0], len) != (ssize_t)len) {
+        ::close(fd);
+        throw std::runtime_error("failed to write free page list");
+    }
+
+    ::fsync(fd);
+    ::close(fd);
+
+    if (::rename(tmp_filename.c_str(), filename.c_str()) < 0)
+        throw std::runtime_error("failed to replace free page list");
+}
+
+} // namespace tagtree
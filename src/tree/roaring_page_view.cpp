@@ -0,0 +1,73 @@
+#include "tagtree/tree/roaring_page_view.h"
+
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+namespace tagtree {
+
+unsigned int RoaringPageView::find_item(SymbolTable::Ref value_ref,
+                                        unsigned int segsel) const
+{
+    for (unsigned int i = 1; i <= get_item_count(); i++) {
+        auto [buf, len] = get_item(i);
+        assert(len >= ITEM_HEADER_SIZE);
+
+        auto item_ref = *(const SymbolTable::Ref*)buf;
+        auto item_segsel = *(const uint32_t*)&buf[sizeof(SymbolTable::Ref)];
+
+        if (item_ref == value_ref && item_segsel == segsel) return i;
+    }
+
+    return NO_TARGET;
+}
+
+bool RoaringPageView::get_postings(SymbolTable::Ref value_ref,
+                                   unsigned int segsel, Roaring& bitmap) const
+{
+    auto offset = find_item(value_ref, segsel);
+    if (offset == NO_TARGET) return false;
+
+    auto [buf, len] = get_item(offset);
+    bitmap = Roaring::read((const char*)&buf[ITEM_HEADER_SIZE], true);
+
+    return true;
+}
+
+bool RoaringPageView::insert(SymbolTable::Ref value_ref, unsigned int segsel,
+                             const Roaring& bitmap)
+{
+    std::vector<uint8_t> buf(get_item_size(bitmap));
+
+    if (buf.size() > get_free_space()) return false;
+
+    ::memcpy(&buf[0], &value_ref, sizeof(SymbolTable::Ref));
+    *(uint32_t*)&buf[sizeof(SymbolTable::Ref)] = (uint32_t)segsel;
+    bitmap.write((char*)&buf[ITEM_HEADER_SIZE], true);
+
+    return put_item(&buf[0], buf.size(), NO_TARGET, false) !=
+           (unsigned int)-1;
+}
+
+std::ostream& operator<<(std::ostream& os, const RoaringPageView& self)
+{
+    os << "{";
+
+    bool first = true;
+    for (unsigned int i = 1; i <= self.get_item_count(); i++) {
+        if (!first) os << ", ";
+
+        auto [buf, len] = self.get_item(i);
+        auto item_ref = *(const SymbolTable::Ref*)buf;
+        auto item_segsel = *(const uint32_t*)&buf[sizeof(SymbolTable::Ref)];
+        os << item_ref << "@" << item_segsel << " -> "
+           << (len - RoaringPageView::ITEM_HEADER_SIZE) << " bytes";
+        first = false;
+    }
+
+    os << "}";
+
+    return os;
+}
+
+} // namespace tagtree
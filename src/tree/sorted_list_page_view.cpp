@@ -1,50 +1,66 @@
 #include "tagtree/tree/sorted_list_page_view.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 
 namespace tagtree {
 
-#define SGN(x) (((x) > 0) ? 1 : (((x) < 0) ? -1 : 0))
-
-std::tuple<SymbolTable::Ref, TSID>
-SortedListPageView::extract_item(unsigned int offset) const
+static size_t put_varint(uint64_t v, uint8_t* out)
 {
-    assert(offset <= get_item_count());
-    auto [buf, len] = get_item(offset);
-    assert(len == sizeof(SymbolTable::Ref) + sizeof(TSID));
+    size_t n = 0;
 
-    auto key_len = sizeof(SymbolTable::Ref);
-    auto key = *(SymbolTable::Ref*)buf;
-    auto tsid = *(TSID*)&buf[key_len];
+    while (v >= 0x80) {
+        out[n++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
 
-    return std::tie(key, tsid);
+    return n;
 }
 
-void SortedListPageView::serialize_item(SymbolTable::Ref key, TSID value,
-                                        std::vector<uint8_t>& out)
+static uint64_t get_varint(const uint8_t*& p)
 {
-    out.resize(sizeof(SymbolTable::Ref) + sizeof(TSID));
-    ::memcpy(&out[0], &key, sizeof(SymbolTable::Ref));
-    ::memcpy(&out[sizeof(SymbolTable::Ref)], &value, sizeof(TSID));
+    uint64_t v = 0;
+    int shift = 0;
+
+    while (*p & 0x80) {
+        v |= (uint64_t)(*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    v |= (uint64_t)(*p++) << shift;
+
+    return v;
 }
 
-size_t SortedListPageView::binary_search_page(SymbolTable::Ref key, TSID value,
-                                              bool next_key)
+size_t SortedListPageView::estimate_block_size(size_t count, TSID first,
+                                               TSID last)
 {
-    auto low = FIRST_KEY_OFFSET;
-    auto high = get_item_count() + 1;
-    int cond = next_key ? 0 : 1;
+    uint8_t vbuf[10];
 
-    while (low < high) {
-        auto mid = (high + low) >> 1;
+    if (count <= 1) return sizeof(BlockHeader);
 
-        auto [mid_key, tsid] = extract_item(mid);
+    /* assume evenly spaced TSIDs */
+    auto delta = std::max<uint64_t>((last - first) / (count - 1), 1);
+    return sizeof(BlockHeader) + (count - 1) * put_varint(delta, vbuf);
+}
 
-        int cmp = SGN((int32_t)key - (int32_t)mid_key);
-        if (cmp == 0) cmp = SGN((int64_t)value - (int64_t)tsid);
+void SortedListPageView::init_page()
+{
+    ::memset(buf, 0, size);
+    set_num_blocks(0);
+    set_num_postings(0);
+}
 
-        if (cmp >= cond)
+unsigned int SortedListPageView::find_block(SymbolTable::Ref key) const
+{
+    unsigned int low = 0;
+    unsigned int high = get_num_blocks();
+
+    while (low < high) {
+        auto mid = (low + high) >> 1;
+
+        if (get_block(mid)->key < key)
             low = mid + 1;
         else
             high = mid;
@@ -53,25 +69,58 @@ size_t SortedListPageView::binary_search_page(SymbolTable::Ref key, TSID value,
     return low;
 }
 
-void SortedListPageView::get_values(SymbolTable::Ref key,
-                                    std::vector<TSID>& values)
+void SortedListPageView::decode_block(const BlockHeader* block,
+                                      std::vector<TSID>& values) const
 {
-    values.clear();
+    const uint8_t* p = &buf[block->offset];
+    const uint8_t* lim = p + block->length;
+    TSID tsid = block->first;
 
-    auto [first_key, first_tsid] = extract_item(FIRST_KEY_OFFSET);
-    if (first_key > key) return;
+    values.push_back(tsid);
+    while (p < lim) {
+        tsid += get_varint(p);
+        values.push_back(tsid);
+    }
+}
 
-    auto [last_key, last_tsid] = extract_item(get_item_count());
-    if (last_key < key) return;
+void SortedListPageView::encode_block(const std::vector<TSID>& values,
+                                      std::vector<uint8_t>& out)
+{
+    uint8_t vbuf[10];
 
-    int i = binary_search_page(key, 0, false);
-    for (; i <= get_item_count(); i++) {
-        auto [item_key, tsid] = extract_item(i);
+    out.clear();
+    for (size_t i = 1; i < values.size(); i++) {
+        auto n = put_varint(values[i] - values[i - 1], vbuf);
+        out.insert(out.end(), vbuf, vbuf + n);
+    }
+}
 
-        if (item_key != key) break;
+void SortedListPageView::grow_block(unsigned int idx, size_t length)
+{
+    auto* block = get_block(idx);
+    size_t data_start = get_data_start();
+    size_t block_end = block->offset + block->length;
 
-        values.push_back(tsid);
+    assert(length <= get_free_space());
+
+    ::memmove(&buf[data_start - length], &buf[data_start],
+              block_end - data_start);
+
+    for (unsigned int i = 0; i <= idx; i++) {
+        get_block(i)->offset -= length;
     }
+    block->length += length;
+}
+
+void SortedListPageView::get_values(SymbolTable::Ref key,
+                                    std::vector<TSID>& values)
+{
+    values.clear();
+
+    auto idx = find_block(key);
+    if (idx == get_num_blocks() || get_block(idx)->key != key) return;
+
+    decode_block(get_block(idx), values);
 }
 
 void SortedListPageView::scan_values(std::function<bool(SymbolTable::Ref)> pred,
@@ -79,25 +128,151 @@ void SortedListPageView::scan_values(std::function<bool(SymbolTable::Ref)> pred,
 {
     values.clear();
 
-    for (int i = 1; i <= get_item_count(); i++) {
-        auto [item_key, tsid] = extract_item(i);
+    for (unsigned int i = 0; i < get_num_blocks(); i++) {
+        auto* block = get_block(i);
 
-        if (pred(item_key)) values.push_back(tsid);
+        if (pred(block->key)) decode_block(block, values);
+    }
+}
+
+void SortedListPageView::get_postings(
+    std::vector<std::pair<SymbolTable::Ref, TSID>>& postings)
+{
+    std::vector<TSID> values;
+
+    for (unsigned int i = 0; i < get_num_blocks(); i++) {
+        auto* block = get_block(i);
+
+        values.clear();
+        decode_block(block, values);
+
+        for (auto&& value : values) {
+            postings.emplace_back(block->key, value);
+        }
     }
 }
 
 bool SortedListPageView::insert(SymbolTable::Ref key, TSID value)
 {
-    std::vector<uint8_t> buf;
+    auto idx = find_block(key);
+    auto num_blocks = get_num_blocks();
+
+    if (idx == num_blocks || get_block(idx)->key != key) {
+        /* new block without data */
+        if (sizeof(BlockHeader) > get_free_space()) return false;
+
+        uint16_t offset = idx == num_blocks ? size : get_block(idx)->offset;
+
+        ::memmove(get_block(idx + 1), get_block(idx),
+                  (num_blocks - idx) * sizeof(BlockHeader));
+
+        auto* block = get_block(idx);
+        block->key = key;
+        block->offset = offset;
+        block->length = 0;
+        block->first = block->last = value;
+
+        set_num_blocks(num_blocks + 1);
+        set_num_postings(get_num_postings() + 1);
+        return true;
+    }
+
+    auto* block = get_block(idx);
+
+    if (value > block->last) {
+        /* TSIDs are mostly inserted in ascending order */
+        uint8_t vbuf[10];
+        auto n = put_varint(value - block->last, vbuf);
+
+        if (n > get_free_space()) return false;
+
+        grow_block(idx, n);
+        ::memcpy(&buf[block->offset + block->length - n], vbuf, n);
+        block->last = value;
+    } else {
+        std::vector<TSID> values;
+        std::vector<uint8_t> data;
+
+        decode_block(block, values);
+
+        auto it = std::lower_bound(values.begin(), values.end(), value);
+        if (it != values.end() && *it == value) return true;
+        values.insert(it, value);
+
+        encode_block(values, data);
+        assert(data.size() >= block->length);
+
+        if (data.size() - block->length > get_free_space()) return false;
+
+        grow_block(idx, data.size() - block->length);
+        ::memcpy(&buf[block->offset], &data[0], data.size());
+        block->first = values.front();
+    }
+
+    set_num_postings(get_num_postings() + 1);
+    return true;
+}
+
+SortedListPageBuilder::SortedListPageBuilder(size_t size)
+    : size(size), num_postings(0)
+{
+    data.reserve(size);
+}
+
+bool SortedListPageBuilder::add(SymbolTable::Ref key, TSID value)
+{
+    if (!blocks.empty() && blocks.back().key == key) {
+        auto& block = blocks.back();
+        uint8_t vbuf[10];
+
+        assert(value >= block.last);
+        if (value == block.last) return true;
+
+        auto n = put_varint(value - block.last, vbuf);
+        if (n > get_free_space()) return false;
+
+        data.insert(data.end(), vbuf, vbuf + n);
+        block.length += n;
+        block.last = value;
+    } else {
+        assert(blocks.empty() || blocks.back().key < key);
+
+        if (sizeof(SortedListPageView::BlockHeader) > get_free_space())
+            return false;
+
+        blocks.emplace_back();
+        auto& block = blocks.back();
+        block.key = key;
+        block.offset = data.size();
+        block.length = 0;
+        block.first = block.last = value;
+    }
 
-    serialize_item(key, value, buf);
-    assert(buf.size() == sizeof(SymbolTable::Ref) + sizeof(TSID));
+    num_postings++;
+    return true;
+}
 
-    if (buf.size() > get_free_space()) return false;
+void SortedListPageBuilder::finish(uint8_t* buf)
+{
+    SortedListPageView page_view(buf, size);
+    size_t data_start = size - data.size();
 
-    int offset = binary_search_page(key, value, false);
+    page_view.init_page();
+    page_view.set_num_blocks(blocks.size());
+    page_view.set_num_postings(num_postings);
 
-    return put_item(&buf[0], buf.size(), offset, false) != -1;
+    for (unsigned int i = 0; i < blocks.size(); i++) {
+        auto* block = page_view.get_block(i);
+
+        *block = blocks[i];
+        block->offset += data_start;
+    }
+
+    if (!data.empty()) ::memcpy(&buf[data_start], &data[0], data.size());
+
+    num_postings = 0;
+    blocks.clear();
+    data.clear();
 }
 
 std::ostream& operator<<(std::ostream& os, const SortedListPageView& self)
@@ -105,13 +280,18 @@ std::ostream& operator<<(std::ostream& os, const SortedListPageView& self)
     os << "{";
 
     bool first = true;
-    for (int i = SortedListPageView::FIRST_KEY_OFFSET;
-         i <= self.get_item_count(); i++) {
-        if (!first) os << ", ";
+    for (unsigned int i = 0; i < self.get_num_blocks(); i++) {
+        auto* block = self.get_block(i);
+        std::vector<TSID> values;
+
+        self.decode_block(block, values);
+
+        for (auto&& value : values) {
+            if (!first) os << ", ";
 
-        auto [key, value] = self.extract_item(i);
-        os << key << " -> " << value;
-        first = false;
+            os << block->key << " -> " << value;
+            first = false;
+        }
     }
 
     os << "}";